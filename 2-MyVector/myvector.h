@@ -209,4 +209,229 @@ public:
 			capacity_ = min_capacity;
 		}
 	}
-};
\ No newline at end of file
+};
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+// Same interface as myvector, but the storage is a memory-mapped file.
+// Reopening the file gives back the vector that was written to it, no deserialization needed.
+// Growing the file can fail (disk full, no address space), so methods that grow report it.
+// Sizes are 64-bit, a file isn't limited to 2^31 items like myvector
+template<typename T>
+	class mmapvector {
+	static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can live in a file");
+public:
+	static const int DEFAULT_CAPACITY = 1024;
+private:
+	// Stored at the start of the file, data follows at DATA_OFFSET
+	struct Header {
+		unsigned int magic;
+		unsigned int item_size;
+		int64_t size;
+		int64_t capacity;
+	};
+	static const unsigned int MAGIC = 0x3245564D; // "MVE2", files with 32-bit sizes had "MVEC"
+	static const size_t DATA_OFFSET = 64;
+	static_assert(alignof(T) <= DATA_OFFSET, "Type alignment is too strict for the file layout");
+
+	int fd_{ -1 };
+	Header * header_{ nullptr };
+	T * data_{ nullptr };
+	size_t mapped_{ 0 };
+private:
+	// Largest capacity whose file size still fits in off_t
+	static int64_t max_capacity() {
+		return static_cast<int64_t>((INT64_MAX - DATA_OFFSET) / sizeof(T));
+	}
+
+	static size_t file_size(int64_t capacity) {
+		return DATA_OFFSET + static_cast<size_t>(capacity)*sizeof(T);
+	}
+
+	void set_mapping(void * p, size_t bytes) {
+		header_ = reinterpret_cast<Header *>(p);
+		data_ = reinterpret_cast<T *>(reinterpret_cast<char *>(p) + DATA_OFFSET);
+		mapped_ = bytes;
+	}
+
+	// Fails only when the vector is already at max_capacity() or the file can't be extended
+	bool grow() {
+		int64_t current = capacity();
+		if (current > (max_capacity() - 1) / GROWTH_FACTOR)
+			return current < max_capacity() && reserve(max_capacity());
+		return reserve(current * GROWTH_FACTOR + 1);
+	}
+
+	void close() {
+		if (header_)
+			munmap(header_, mapped_);
+		if (fd_ >= 0)
+			::close(fd_);
+		header_ = nullptr;
+		data_ = nullptr;
+		mapped_ = 0;
+		fd_ = -1;
+	}
+
+public:
+	// Opens an existing vector file or creates a new one
+	explicit mmapvector(const char * filename) {
+		fd_ = open(filename, O_RDWR | O_CREAT, 0644);
+		if (fd_ < 0)
+			return;
+		struct stat info;
+		if (fstat(fd_, &info) != 0) {
+			close();
+			return;
+		}
+		bool created = info.st_size == 0;
+		size_t bytes = created ? file_size(DEFAULT_CAPACITY) : static_cast<size_t>(info.st_size);
+		if (created && ftruncate(fd_, bytes) != 0) {
+			close();
+			return;
+		}
+		void * p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		if (p == MAP_FAILED) {
+			header_ = nullptr;
+			close();
+			return;
+		}
+		set_mapping(p, bytes);
+		if (created) {
+			header_->magic = MAGIC;
+			header_->item_size = sizeof(T);
+			header_->size = 0;
+			header_->capacity = DEFAULT_CAPACITY;
+		}
+		else if (bytes < DATA_OFFSET || header_->magic != MAGIC || header_->item_size != sizeof(T)
+			|| header_->capacity < 0 || header_->capacity > max_capacity() || file_size(header_->capacity) > bytes
+			|| header_->size < 0 || header_->size > header_->capacity) {
+			close(); // Not our file or written for a different type
+		}
+	}
+
+	~mmapvector() {
+		close();
+	}
+
+	mmapvector(const mmapvector<T> &) = delete;
+	mmapvector<T> &operator=(const mmapvector<T> &) = delete;
+
+	bool is_open() const {
+		return header_ != nullptr;
+	}
+
+	// Flush changes to the file. Async only schedules the write
+	void sync(bool async = false) {
+		assert(is_open());
+		msync(header_, mapped_, async ? MS_ASYNC : MS_SYNC);
+	}
+
+	// Both are 0 if the file couldn't be opened
+	int64_t capacity() const {
+		return header_ ? header_->capacity : 0;
+	}
+
+	int64_t size() const {
+		return header_ ? header_->size : 0;
+	}
+
+	bool add(const T & value) {
+		if (size() == capacity() && !grow())
+			return false;
+		data_[header_->size++] = value;
+		return true;
+	};
+
+	// nullptr if the vector couldn't grow
+	T * add() {
+		if (size() == capacity() && !grow())
+			return nullptr;
+		new (data_ + header_->size) T();
+		return data_ + header_->size++;
+	};
+
+	void erase(int64_t index) {
+		assert(index >= 0 && index < size());
+		T * dest = data_ + index;
+		memmove(dest, dest + 1, (header_->size - index - 1)*sizeof(T));
+		header_->size--;
+	}
+
+	bool push_back(const T & value) {
+		return add(value);
+	}
+
+	void erase(const T * item) {
+		erase(static_cast<int64_t>(item - data_));
+	}
+
+	T & operator[](int64_t index) {
+		assert(index >= 0 && index < size());
+		return data_[index];
+	}
+
+	const T & operator[](int64_t index) const {
+		assert(index >= 0 && index < size());
+		return data_[index];
+	}
+
+	T * begin() const {
+		return data_;
+	}
+
+	T * end() const {
+		return data_ + size();
+	}
+
+	T & back() const {
+		assert(size() > 0);
+		return data_[header_->size - 1];
+	}
+
+	void clear() {
+		if (header_)
+			header_->size = 0;
+	}
+
+	bool resize(int64_t new_size) {
+		if (new_size <= size()) {
+			if (header_)
+				header_->size = new_size;
+			return true;
+		}
+		if (!reserve(new_size))
+			return false;
+		int64_t add_count = new_size - size();
+		for (int64_t i = 0; i < add_count; ++i) {
+			add();
+		}
+		return true;
+	}
+
+	// File is extended in place, mapping is moved only if kernel can't grow it where it is.
+	// On failure the vector stays as it was
+	bool reserve(int64_t min_capacity) {
+		if (min_capacity <= capacity())
+			return true;
+		if (!is_open() || min_capacity > max_capacity())
+			return false;
+		size_t bytes = file_size(min_capacity);
+		if (ftruncate(fd_, bytes) != 0)
+			return false;
+		void * p = mremap(header_, mapped_, bytes, MREMAP_MAYMOVE);
+		if (p == MAP_FAILED)
+			return false; // Longer file is harmless, capacity in the header still matches the mapping
+		set_mapping(p, bytes);
+		header_->capacity = min_capacity;
+		return true;
+	}
+};
+
+#endif
\ No newline at end of file
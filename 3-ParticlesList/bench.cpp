@@ -0,0 +1,14 @@
+// Runs the benchmarks of my.cpp: scripted emission profiles, defragmentation and the concurrent allocator.
+// Build and run: g++ -std=c++17 -O2 -pthread bench.cpp -o bench && ./bench
+// Add -D__NO_POOL_ALLOCATOR__ to get System with plain new/delete, -mavx2 for the vectorized SoA update
+
+#define __PARTICLES_BENCH__
+
+#include "harness.h"
+#include "my.cpp"
+
+int main()
+{
+	RunParticleBenchmarks();
+	return 0;
+}
\ No newline at end of file
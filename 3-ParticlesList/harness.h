@@ -0,0 +1,54 @@
+// Minimal stand-in for the course framework, so drivers can build my.cpp on their own.
+// Only what my.cpp uses is declared: particle and system interfaces, vectors and settings
+#pragma once
+
+#include <list>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+
+#ifndef _MSC_VER
+#define __forceinline inline __attribute__((always_inline))
+#endif
+
+struct vec3
+{
+	float x{ 0 }, y{ 0 }, z{ 0 };
+	vec3() {}
+	vec3(float x, float y, float z) : x(x), y(y), z(z) {}
+};
+
+struct Settings
+{
+	float emission_delay_min{ 0.001f };
+	float emission_delay_max{ 0.002f };
+	float ttl_min{ 1 };
+	float ttl_max{ 2 };
+};
+
+struct IParticle
+{
+	vec3 pos;
+	vec3 vel;
+	float ttl{ 0 };
+};
+
+template<typename T>
+class ISystem
+{
+public:
+	ISystem(vec3 system_pos, const Settings & s) : pos(system_pos), settings(s) {}
+	virtual ~ISystem() {}
+	int Count() const { return count; }
+protected:
+	virtual T Create() = 0;
+	virtual T Kill(T p) = 0;
+	virtual T GetFirst() = 0;
+	virtual T GetEnd() = 0;
+	virtual T GetNext(T p) = 0;
+
+	vec3 pos;
+	Settings settings;
+	int count{ 0 };
+};
\ No newline at end of file
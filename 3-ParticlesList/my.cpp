@@ -1,9 +1,49 @@
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-// Enable allocation of new particles from pool
+// Enable allocation of new particles from pool. Define __NO_POOL_ALLOCATOR__ to compare with plain new/delete
+#ifndef __NO_POOL_ALLOCATOR__
 #define __POOL_ALLOCATOR__
+#endif
+// Compile benchmarks, bench.cpp defines it and runs them
+//#define __PARTICLES_BENCH__
+// Collect per-frame profiling data of particle systems
+//#define __PARTICLES_PROFILE__
+
+#ifdef __PARTICLES_PROFILE__
+#define __PROFILE_COUNT(counter, n) profile.counter += n
+#define __PROFILE_TIME() ProfileTimer profile_timer(profile)
+#else
+#define __PROFILE_COUNT(counter, n)
+#define __PROFILE_TIME()
+#endif
+
+#if defined(__PARTICLES_BENCH__) || defined(__PARTICLES_PROFILE__)
+#include <cstdio>
+#endif
+
+#ifdef __PARTICLES_BENCH__
+#ifdef __linux__
+#include <unistd.h>
+#include <malloc.h>
+#endif
+#endif
 
 /************************************* Declaration *******************************************/
 
@@ -12,6 +52,87 @@ struct Particle : public IParticle
 {
 	Particle * next{ nullptr };
 	Particle * prev{ nullptr };
+	// Timing wheel links live in the particle itself (24 bytes more), so scheduling never allocates and
+	// Kill takes a particle out of its slot in O(1). A side table would need its own index per particle
+	// and cost an extra cache miss on every Create and Kill
+	Particle * wheel_next{ nullptr };
+	Particle * wheel_prev{ nullptr };
+	unsigned expiry{ 0 }; // Tick the slot is drained at, 0 if the particle isn't in the wheel
+	int wheel_slot{ 0 };
+};
+
+// Hierarchical timing wheel of particles bucketed by the tick they expire at.
+// Level 0 has a slot per tick, every next level has a slot per full turn of the previous one.
+// A slot only tells when to look at a particle again: it dies when its ttl is down to 0, same as without the wheel
+class TimingWheel
+{
+public:
+	static const int LEVELS = 4;
+	static const int SLOT_BITS = 6;
+	static const int SLOTS = 1 << SLOT_BITS;
+
+	explicit TimingWheel(float tick);
+
+	// Schedule the particle by its current ttl. Particles due within two ticks are checked on every Advance
+	void Add(Particle * p);
+	void Remove(Particle * p);
+	// Advance time by dt and call f(Particle *) for every scheduled particle with ttl <= 0.
+	// Particles whose ttl was raised meanwhile are scheduled again. Particles are already out of the wheel when f is called
+	template<typename F>
+	void Advance(float dt, F && f);
+private:
+	// Extra slot after all levels for particles due before the next two ticks pass
+	static const int SOON = LEVELS * SLOTS;
+
+	float tick;
+	float elapsed{ 0 }; // Time since the last whole tick
+	unsigned now{ 1 };
+	Particle * slots[LEVELS * SLOTS + 1];
+
+	// Put the particle into a slot according to its expiry
+	void Insert(Particle * p);
+	void Link(Particle * p, int slot);
+	// Take out a whole slot as a chain
+	Particle * Detach(int slot);
+	// Call f for every particle of the chain that is dead, schedule the rest again
+	template<typename F>
+	void Check(Particle * chain, F & f);
+};
+
+// Part of a system handed to ForEachChunk callbacks, iterates over particles without virtual calls
+template<typename It>
+struct ParticleChunk
+{
+	It first, last;
+	It begin() const { return first; }
+	It end() const { return last; }
+};
+
+// Run of SoaSystem particles: pointers to the fields of the first particle in the chunk
+struct SoaChunk
+{
+	float * pos_x, * pos_y, * pos_z;
+	float * vel_x, * vel_y, * vel_z;
+	float * ttl;
+	int count;
+};
+
+// Particle system that can be updated by the scheduler.
+// Integration of independent particles may be split between threads, expiry is done once per system
+class ISimulation
+{
+public:
+	virtual ~ISimulation() {}
+	// Constant acceleration applied to all particles (gravity, wind)
+	vec3 acceleration{ 0, 0, 0 };
+	// Number of particles addressable by index. Systems without random access return 0 and are updated by a single job
+	virtual int SplitCount() { return 0; }
+	// Move and age particles in [begin, end). Only called for systems with a non-zero SplitCount
+	virtual void IntegrateRange(float /*dt*/, int /*begin*/, int /*end*/) {}
+	// Move and age all particles
+	virtual void Integrate(float dt) = 0;
+	// Kill expired particles, called after the whole system is integrated
+	virtual void Finish(float dt) = 0;
 };
 
 // Reserved pool of memory for faster creation and deletion of particles
@@ -26,23 +147,334 @@ public:
 
 	Particle * Create();
 	void Kill(Particle * p);
-private:	
-	vector<Particle *> pools;
-	// Available spots in pools for creation of new particles. Wastes memory, but hopefully improves preformance
-	vector<Particle *> free_spots;
+	// Create n particles linked through next/prev, last one is returned through the argument
+	Particle * CreateChain(int n, Particle *& last);
+	// Release pools without live particles, one pool is always kept. Returns the number of released pools
+	int Trim();
+	int PoolCount() const;
+	// First live particle at or after the given address in memory order, nullptr if there are none
+	Particle * NextLive(Particle * from) const;
+
+	// Runtime telemetry used for sizing pools
+	struct Stats {
+		int live{ 0 }; // Particles in use
+		int high_water{ 0 }; // Maximum of live particles ever
+		int capacity{ 0 }; // Spots in all pools
+		int pools_added{ 0 };
+		int hot_adds{ 0 }; // Pools that had to be allocated inside Create, not counting the first one
+		float rate{ 0 }; // Smoothed number of particles created per frame
+	};
+	const Stats & GetStats() const;
+	// Call once per frame outside of the hot path: updates telemetry and grows pools ahead of demand
+	void Maintain();
+private:
+	// Frames of creations at the current rate that free spots should cover
+	static const int LOOKAHEAD_FRAMES = 2;
+	// Pools grow geometrically up to this size
+	static const int MAX_POOL_SIZE = 1 << 20;
+
+	// Continuous block of memory for particles
+	struct Pool {
+		Particle * data;
+		int size;
+		int used; // Live particles in the pool
+		Particle * fresh; // Spots from here to the end of the pool were never used
+		Particle * free; // Spots released by Kill, linked through Particle::next
+	};
+	// Sorted by address, so the pool of a particle can be found with binary search
+	vector<Pool> pools;
+	// Pool new particles are taken from
+	int current{ -1 };
+	// Size of the first pool
 	int pool_size;
+	Stats stats;
+	int created{ 0 }; // Particles created since the last Maintain
 
-	// Estimate a number of concurrent particles needed for a system
+	// Estimate a number of concurrent particles needed for a system, used as the size of the first pool
 	int Estimate(const Settings & s);
-	// Allocate new pool and add it to the list
-	void AddPool();
+	// Allocate new pool of at least min_size and add it to the list. Every new pool is as big as all previous together
+	void AddPool(int min_size = 0);
+	// Make current the lowest pool with a free spot, adding a new pool if all are full
+	void SelectPool();
+	// Index of the pool containing the particle
+	int FindPool(Particle * p) const;
+};
+
+// Thread-safe lock-free version of ParticleAllocator.
+// Free spots form a Treiber stack of indices, the top is tagged with a counter to prevent ABA.
+// Memory is only released when the allocator is destroyed
+class ConcurrentParticleAllocator
+{
+public:
+	static const int MAX_POOLS = 4096;
+
+	// Set single pool size
+	explicit ConcurrentParticleAllocator(int pool_size);
+	// Set pool size by system setting
+	explicit ConcurrentParticleAllocator(const Settings & s);
+	~ConcurrentParticleAllocator();
+
+	// nullptr when all MAX_POOLS pools are used up or memory is out
+	Particle * Create();
+	void Kill(Particle * p);
+	int PoolCount() const;
+
+	// Per-thread cache of free spots. Moves them to and from the shared stack in batches,
+	// so most of Create and Kill calls don't touch shared state at all
+	class Magazine
+	{
+	public:
+		explicit Magazine(ConcurrentParticleAllocator & allocator);
+		~Magazine();
+
+		Particle * Create();
+		void Kill(Particle * p);
+	private:
+		static const int SIZE = 64;
+		ConcurrentParticleAllocator & allocator;
+		unsigned spots[SIZE];
+		int count{ 0 };
+	};
+private:
+	// Pool memory is aligned to its size, so the pool of a particle is found by masking its address.
+	// Header is followed by links of the free spots stack and then by particles
+	struct PoolHeader {
+		int index;
+	};
+	size_t pool_bytes;
+	int pool_size; // Particles in a pool
+	size_t particles_offset;
+	atomic<PoolHeader *> pools[MAX_POOLS];
+	atomic<int> pool_count{ 0 };
+	// Index of the top spot + 1 in the lower half (0 is an empty stack), tag in the upper half
+	atomic<unsigned long long> top{ 0 };
+
+	Particle * GetParticle(unsigned index) const;
+	unsigned GetIndex(Particle * p) const;
+	atomic<unsigned> & Link(unsigned index) const;
+	// Take up to count spots from the stack with a single CAS. Returns number of taken spots
+	int Pop(unsigned * spots, int count);
+	// Put spots on the stack with a single CAS
+	void Push(const unsigned * spots, int count);
+	// Allocate a new pool, keep one spot of it and push the rest. False if there is no room for another pool
+	bool AddPool(unsigned & spot);
+};
+
+// Render attributes of a system, published once per frame.
+// There are three buffers: simulation fills one, renderer reads another and the third holds the latest
+// published frame. Publishing and acquiring swap buffer indices atomically, so neither side ever waits
+class RenderSnapshot
+{
+public:
+	struct Attributes {
+		vec3 pos;
+		float ttl;
+	};
+
+	// Simulation side: buffer to fill during the update
+	vector<Attributes> & Back();
+	// Simulation side: make the filled buffer the latest frame
+	void Publish();
+	// Render side: the latest published frame. Stays untouched by simulation until the next Acquire
+	const vector<Attributes> & Acquire();
+private:
+	// Set in latest when the buffer wasn't acquired yet
+	static const int FRESH = 4;
+	vector<Attributes> buffers[3];
+	int back{ 0 };
+	int front{ 1 };
+	atomic<int> latest{ 2 };
+};
+
+// Spatial hash over a uniform grid of cubic cells, rebuilt from scratch every frame with a counting sort.
+// Cells are hashed into a fixed number of buckets, so the grid is unbounded and queries filter by actual position
+class ParticleGrid
+{
+public:
+	// Cell size should be close to the typical query radius
+	explicit ParticleGrid(float cell_size, int bucket_bits = 12);
+
+	// Add a particle to the next rebuild
+	void Add(IParticle * p);
+	// Sort added particles by buckets. Previous contents are replaced
+	void Rebuild();
+	// Call f(IParticle *) for every particle within radius from the center
+	template<typename F>
+	void QueryRadius(const vec3 & center, float radius, F && f) const;
+	// Call f(IParticle *) for every particle inside the box
+	template<typename F>
+	void QueryBox(const vec3 & min, const vec3 & max, F && f) const;
+private:
+	struct Item {
+		IParticle * p;
+		vec3 pos; // Copy of the position, so queries don't chase pointers
+	};
+	float inv_cell_size;
+	int bucket_count;
+	vector<Item> pending; // Added since the last rebuild
+	vector<unsigned> pending_buckets;
+	vector<int> starts; // First item of every bucket, bucket_count + 1 entries
+	vector<Item> items; // Sorted by bucket
+	mutable vector<unsigned> query_buckets; // Reused by every query, so queries from several threads must not overlap
+
+	// Cell coordinate, clamped so far away or NaN positions land in the border cells
+	static const int CELL_LIMIT = 1 << 19;
+	int Cell(float v) const;
+	unsigned Bucket(int x, int y, int z) const;
+	// Call f(item) for every item in buckets of cells overlapping the box, each bucket visited once
+	template<typename F>
+	void VisitCells(const vec3 & min, const vec3 & max, F && f) const;
+};
+
+#ifdef __PARTICLES_PROFILE__
+
+// What a system did during one frame
+struct ProfileSample
+{
+	const void * system{ nullptr };
+	int frame{ 0 };
+	int thread{ 0 };
+	int creates{ 0 };
+	int kills{ 0 };
+	int live{ 0 };
+	int pool_adds{ 0 };
+	double begin{ 0 }; // Microseconds since the profiler started
+	double update{ 0 }; // Microseconds spent in Integrate and Finish
 };
 
+// Power of 2 buckets: bucket i counts values in [2^(i-1), 2^i)
+struct Histogram
+{
+	static const int BUCKETS = 32;
+	int buckets[BUCKETS] = {};
+	void Add(double value);
+};
+
+// Totals of all systems for a frame
+struct FrameProfile
+{
+	int frame{ 0 };
+	int systems{ 0 };
+	int creates{ 0 };
+	int kills{ 0 };
+	int live{ 0 };
+	int pool_adds{ 0 };
+	double end{ 0 };
+	Histogram update_time; // Microseconds per system
+	Histogram live_count; // Particles per system
+};
+
+// Fixed number of the latest items, every new one overwrites the oldest
+template<typename T>
+class Ring
+{
+public:
+	explicit Ring(size_t capacity) : capacity(capacity) {}
+	void Add(const T & item)
+	{
+		if (items.size() < capacity)
+			items.push_back(item);
+		else
+			items[next % capacity] = item;
+		next++;
+	}
+	// Call f(const T &) from the oldest item to the newest
+	template<typename F>
+	void ForEach(F && f) const
+	{
+		for (size_t i = next - items.size(); i < next; i++)
+			f(items[i % capacity]);
+	}
+private:
+	size_t capacity;
+	vector<T> items;
+	size_t next{ 0 }; // Items ever added
+};
+
+// Gathers samples from systems. Each thread writes to its own buffer without locks,
+// buffers are merged by EndFrame, which must be called between frames when no system is updating.
+// Only the latest samples and frames are kept, so memory doesn't grow however long the run is
+class ParticleProfiler
+{
+public:
+	// Samples and frames kept for export
+	static const size_t MAX_SAMPLES = 1 << 16;
+	static const size_t MAX_FRAMES = 1 << 12;
+
+	static ParticleProfiler & Instance();
+
+	void Record(const ProfileSample & sample);
+	// Close the current frame: merge thread buffers and build histograms
+	void EndFrame();
+	// Write kept samples and frame totals in Chrome trace event format (chrome://tracing, Perfetto)
+	bool Export(const char * filename) const;
+	// Kept frames, oldest first
+	vector<FrameProfile> Frames() const;
+	// Microseconds since the profiler started
+	double Now() const;
+	int Frame() const;
+private:
+	struct ThreadBuffer {
+		int thread;
+		vector<ProfileSample> samples;
+	};
+	chrono::steady_clock::time_point start;
+	int frame{ 0 };
+	mutex registry_lock; // Only taken when a thread records its first sample
+	vector<unique_ptr<ThreadBuffer>> buffers;
+	Ring<ProfileSample> samples;
+	Ring<FrameProfile> frames;
+
+	ParticleProfiler();
+	ThreadBuffer & LocalBuffer();
+};
+
+// Adds the time of its scope to the sample
+class ProfileTimer
+{
+public:
+	explicit ProfileTimer(ProfileSample & sample);
+	~ProfileTimer();
+private:
+	ProfileSample & sample;
+	double begin;
+};
+
+#endif
+
 // Particle system implementing an intrusive linked list
-class System : public ISystem<IParticle *>
+class System : public ISystem<IParticle *>, public ISimulation
 {
 public:
 	explicit System(vec3 system_pos, const Settings & s);
+
+	void Integrate(float dt) override;
+	void Finish(float dt) override;
+	// Return memory of empty pools after a burst of particles
+	void Trim();
+	const ParticleAllocator::Stats & AllocatorStats() const;
+	// Create n particles at once, returns the first of them. The rest follow it in the list
+	IParticle * CreateBatch(int n);
+	// Call after lowering ttl of a live particle other than right after its creation, or it may die late.
+	// New particles are scheduled by the ttl they have at the next Finish, raised ttl is noticed on its own
+	void Reschedule(IParticle * p);
+	// Call f(ParticleChunk<Particle *>) for every run of particles lying one after another in memory.
+	// Runs going down in memory are visited from their lowest address, so particles created one by one
+	// at the head of the list make a single chunk too. Callback must not create or kill particles
+	template<typename F>
+	void ForEachChunk(F && f);
+	// Relink particles so list order follows memory order. Works for at most budget_ms and continues on the next call
+	void Defragment(double budget_ms);
+	// Share of list links that don't lead to the adjacent spot in memory, 0 for a perfectly ordered list
+	float Fragmentation() const;
+	// Start publishing render attributes every frame, so rendering can run concurrently with the next update
+	void EnableSnapshot();
+	// nullptr unless enabled
+	RenderSnapshot * Snapshot();
+	// Start maintaining a spatial index for neighbour queries, rebuilt at the end of every Finish
+	void EnableGrid(float cell_size);
+	// nullptr unless enabled. Valid until particles are created or killed
+	const ParticleGrid * Grid() const;
 protected:
 	IParticle * Create() override;
 	IParticle * Kill(IParticle * p) override;
@@ -53,19 +485,41 @@ private:
 	Particle * first;
 	// Pool allocator for faster list manipulation
 	ParticleAllocator allocator;
+	// Expiry schedule, so dead particles are found without visiting live ones
+	TimingWheel wheel;
+	unique_ptr<RenderSnapshot> snapshot;
+	unique_ptr<ParticleGrid> grid;
+	// Address the current defragmentation sweep continues from, nullptr to start a new one
+	Particle * defrag_cursor{ nullptr };
+	// Last particle put in order by the current sweep, next ones are inserted after it
+	Particle * defrag_placed{ nullptr };
+#ifdef __PARTICLES_PROFILE__
+	ProfileSample profile;
+	int pools_added{ 0 }; // Allocator's count at the end of the last frame
+#endif
 
 	Particle * CreateInternal();
 	void KillInternal(Particle * p);
+	// Create a linked chain of n particles, last one is returned through the argument
+	Particle * CreateChainInternal(int n, Particle *& last);
 };
 
 
 // Particle system based on std::list implementation
 typedef list<IParticle>::iterator ListIt;
 
-class StdSystem : public ISystem<ListIt>
+class StdSystem : public ISystem<ListIt>, public ISimulation
 {
 public:
 	explicit StdSystem(vec3 system_pos, const Settings & s);
+
+	void Integrate(float dt) override;
+	void Finish(float dt) override;
+	// Create n particles at once, returns the first of them. The rest follow it in the list
+	ListIt CreateBatch(int n);
+	// Call f(ParticleChunk<ListIt>) for the whole list. Callback must not create or kill particles
+	template<typename F>
+	void ForEachChunk(F && f);
 protected:
 	ListIt Create() override;
 	ListIt Kill(ListIt p) override;
@@ -76,8 +530,111 @@ private:
 	std::list<IParticle> list;
 };
 
+
+// Particle system storing every particle field in its own contiguous array (structure of arrays).
+// Particles are addressed by index, killing one moves the last particle into its place
+class SoaSystem : public ISystem<int>, public ISimulation
+{
+public:
+	explicit SoaSystem(vec3 system_pos, const Settings & s);
+
+	// Copy particle's fields in and out of the arrays
+	void Get(int i, IParticle & p) const;
+	void Set(int i, const IParticle & p);
+	// Move and age all particles, then kill the ones whose time is up
+	void Simulate(float dt);
+	// Create n particles at once, returns index of the first of them. The rest follow it
+	int CreateBatch(int n);
+	// Call f(SoaChunk) for consecutive ranges of particles. Callback must not create or kill particles
+	template<typename F>
+	void ForEachChunk(F && f);
+	static const int CHUNK_SIZE = 1024;
+
+	int SplitCount() override;
+	void IntegrateRange(float dt, int begin, int end) override;
+	void Integrate(float dt) override;
+	void Finish(float dt) override;
+protected:
+	int Create() override;
+	int Kill(int p) override;
+	int GetFirst() override;
+	int GetEnd() override;
+	int GetNext(int p) override;
+private:
+	vector<float> pos_x, pos_y, pos_z;
+	vector<float> vel_x, vel_y, vel_z;
+	vector<float> ttl;
+
+	void IntegrateScalar(float dt, int begin, int end);
+#ifdef __AVX2__
+	void IntegrateAvx2(float dt, int begin, int end);
+#endif
+	// Kill every particle with ttl <= 0
+	void KillExpired();
+};
+
+// Work-stealing thread pool updating many particle systems per frame.
+// Large systems are split into fixed size ranges, so results don't depend on the number of threads
+class ParticleScheduler
+{
+public:
+	// Systems with more particles than this are integrated by several jobs
+	static const int RANGE_SIZE = 16 * 1024;
+
+	// Zero means a thread per hardware core
+	explicit ParticleScheduler(int threads = 0);
+	~ParticleScheduler();
+
+	// Update all systems for one frame. Calling thread takes part in the work and returns when the frame is done
+	void Update(const vector<ISimulation *> & systems, float dt);
+private:
+	struct Job {
+		ISimulation * sim;
+		float dt;
+		int begin, end; // Particle range of a split system
+		atomic<int> * ranges_left; // Ranges of the system still running, nullptr if the system is updated as a whole
+	};
+	// Owner takes jobs from the back, thieves from the front
+	struct Queue {
+		mutex lock;
+		deque<Job> jobs;
+	};
+
+	vector<thread> workers;
+	vector<unique_ptr<Queue>> queues; // One per worker, the last one belongs to the thread calling Update
+	unique_ptr<atomic<int>[]> counters; // Ranges left for each split system
+	int counters_size{ 0 };
+	atomic<int> pending{ 0 }; // Jobs left in the current frame
+
+	mutex wake_lock;
+	condition_variable wake; // New frame or shutdown
+	condition_variable done; // All jobs of the frame are finished
+	int generation{ 0 };
+	bool stop{ false };
+
+	void WorkerLoop(int index);
+	// Execute jobs until there are none left to take
+	void RunJobs(int index);
+	void Execute(const Job & job);
+	bool Pop(int index, Job & job);
+	bool Steal(int index, Job & job);
+	void Push(int index, const Job & job);
+};
+
 /************************************* Definition *******************************************/
 
+// Basic motion shared by systems storing whole particles, same integration as SoaSystem
+__forceinline void Move(IParticle & p, const vec3 & acceleration, float dt)
+{
+	p.vel.x += acceleration.x * dt;
+	p.vel.y += acceleration.y * dt;
+	p.vel.z += acceleration.z * dt;
+	p.pos.x += p.vel.x * dt;
+	p.pos.y += p.vel.y * dt;
+	p.pos.z += p.vel.z * dt;
+	p.ttl -= dt;
+}
+
 #pragma region "ParticleAllocator: Reserved pool of memory for faster creation and deletion of particles"
 
 ParticleAllocator::ParticleAllocator(int pool_size) 
@@ -90,25 +647,147 @@ ParticleAllocator::ParticleAllocator(const Settings & s)
 
 ParticleAllocator::~ParticleAllocator()
 {
-	for (auto p : pools) {
-		free(p);
+	for (auto & pool : pools) {
+		free(pool.data);
 	}
 }
 
 __forceinline Particle *ParticleAllocator::Create()
 {
-	if (!free_spots.size())
-		AddPool();
-	// Use any free spot from the list
-	Particle * res = free_spots.back();
-	free_spots.pop_back();
-	memset(res, 0, sizeof(Particle));
+	if (current < 0 || pools[current].used == pools[current].size)
+		SelectPool();
+	Pool & pool = pools[current];
+	Particle * res;
+	// Reuse released spots first, they are likely still in cache
+	if (pool.free) {
+		res = pool.free;
+		pool.free = res->next;
+	}
+	else
+		res = pool.fresh++;
+	pool.used++;
+	created++;
+	if (++stats.live > stats.high_water)
+		stats.high_water = stats.live;
+	new (res) Particle();
 	return res;
 }
 
 __forceinline void ParticleAllocator::Kill(Particle *p)
 {
-	free_spots.push_back(p);
+	// Dead spots point back to themselves, so walks in memory order can skip them
+	p->prev = p;
+	stats.live--;
+	Pool & pool = pools[FindPool(p)];
+	if (--pool.used == 0) {
+		// Empty pool is reset to be filled in address order again
+		pool.free = nullptr;
+		pool.fresh = pool.data;
+	}
+	else {
+		p->next = pool.free;
+		pool.free = p;
+	}
+}
+
+Particle * ParticleAllocator::CreateChain(int n, Particle *& last)
+{
+	Particle * head = nullptr;
+	last = nullptr;
+	created += n;
+	stats.live += n;
+	if (stats.live > stats.high_water)
+		stats.high_water = stats.live;
+	while (n > 0) {
+		if (current < 0 || pools[current].used == pools[current].size)
+			SelectPool();
+		Pool & pool = pools[current];
+		// Take as much as possible from the current pool in one go
+		int take = min(n, pool.size - pool.used);
+		pool.used += take;
+		n -= take;
+		Particle * from_free = pool.free;
+		for (; take && from_free; take--) {
+			Particle * p = from_free;
+			from_free = p->next;
+			new (p) Particle();
+			p->prev = last;
+			if (last)
+				last->next = p;
+			else
+				head = p;
+			last = p;
+		}
+		pool.free = from_free;
+		// The rest is a continuous run of never used spots
+		Particle * p = pool.fresh;
+		pool.fresh += take;
+		for (; p < pool.fresh; p++) {
+			new (p) Particle();
+			p->prev = last;
+			if (last)
+				last->next = p;
+			else
+				head = p;
+			last = p;
+		}
+	}
+	return head;
+}
+
+int ParticleAllocator::Trim()
+{
+	int released = 0;
+	for (int i = static_cast<int>(pools.size()) - 1; i >= 0 && pools.size() > 1; i--) {
+		if (!pools[i].used) {
+			stats.capacity -= pools[i].size;
+			free(pools[i].data);
+			pools.erase(pools.begin() + i);
+			released++;
+		}
+	}
+	if (released)
+		current = -1;
+	return released;
+}
+
+int ParticleAllocator::PoolCount() const
+{
+	return static_cast<int>(pools.size());
+}
+
+const ParticleAllocator::Stats & ParticleAllocator::GetStats() const
+{
+	return stats;
+}
+
+void ParticleAllocator::Maintain()
+{
+	stats.rate = stats.rate * 0.9f + created * 0.1f;
+	// A burst is taken into account right away, the average only catches up with it later
+	float rate = max(stats.rate, static_cast<float>(created));
+	created = 0;
+	int headroom = static_cast<int>(rate * LOOKAHEAD_FRAMES);
+	int spare = stats.capacity - stats.live;
+	if (spare < headroom) {
+		AddPool(headroom - spare);
+		current = -1; // Keep filling lower pools first
+	}
+}
+
+Particle * ParticleAllocator::NextLive(Particle * from) const
+{
+	auto it = upper_bound(pools.begin(), pools.end(), from, [](Particle * p, const Pool & x) { return p < x.data; });
+	int count = static_cast<int>(pools.size());
+	for (int i = max(static_cast<int>(it - pools.begin()) - 1, 0); i < count; i++) {
+		const Pool & pool = pools[i];
+		// Spots after fresh were never used
+		for (Particle * p = max(from, pool.data); p < pool.fresh; p++) {
+			if (p->prev != p)
+				return p;
+		}
+	}
+	return nullptr;
 }
 
 int ParticleAllocator::Estimate(const Settings & s)
@@ -120,140 +799,1528 @@ int ParticleAllocator::Estimate(const Settings & s)
 	return static_cast<int>((avg_emit_rate * avg_ttl) * 1.2);
 }
 
-void ParticleAllocator::AddPool()
+void ParticleAllocator::AddPool(int min_size)
+{
+	Pool pool;
+	pool.size = max(max(pool_size, min(stats.capacity, static_cast<int>(MAX_POOL_SIZE))), min_size);
+	pool.data = reinterpret_cast<Particle *>(malloc(pool.size * sizeof(Particle)));
+	stats.capacity += pool.size;
+	stats.pools_added++;
+	pool.used = 0;
+	pool.fresh = pool.data;
+	pool.free = nullptr;
+	auto it = upper_bound(pools.begin(), pools.end(), pool.data, [](Particle * p, const Pool & x) { return p < x.data; });
+	current = static_cast<int>(it - pools.begin());
+	pools.insert(it, pool);
+}
+
+void ParticleAllocator::SelectPool()
 {
-	Particle * pool = reinterpret_cast<Particle *>(malloc(pool_size * sizeof(Particle)));
-	pools.push_back(pool);
-	// The enterity of the new pool goes into free spots vector
-	free_spots.reserve(free_spots.capacity() + pool_size);
-	Particle * end = pool + pool_size;
-	for (Particle * p = pool; p < end; p++) {
-		free_spots.push_back(p);
+	// Filling lower pools first keeps particles packed, so upper pools empty out and can be trimmed
+	int count = static_cast<int>(pools.size());
+	for (current = 0; current < count; current++) {
+		if (pools[current].used < pools[current].size)
+			return;
 	}
+	// Maintain didn't see this coming. The first pool is always made by the first Create, it doesn't count
+	if (count)
+		stats.hot_adds++;
+	AddPool();
+}
+
+__forceinline int ParticleAllocator::FindPool(Particle * p) const
+{
+	// Most of the time particle comes from the current pool
+	if (current >= 0 && p >= pools[current].data && p < pools[current].data + pools[current].size)
+		return current;
+	auto it = upper_bound(pools.begin(), pools.end(), p, [](Particle * p, const Pool & x) { return p < x.data; });
+	assert(it != pools.begin());
+	return static_cast<int>(it - pools.begin()) - 1;
 }
 
 #pragma endregion
 
-#pragma region "System: Particle system implementing an intrusive linked list"
+#pragma region "ConcurrentParticleAllocator: Lock-free pool of particles shared between threads"
 
-System::System(vec3 system_pos, const Settings & s) :
-	ISystem(system_pos, s),
-	first(nullptr),
-	allocator(s)
+ConcurrentParticleAllocator::ConcurrentParticleAllocator(int pool_size)
 {
-
+	if (pool_size <= 0)
+		pool_size = 1000;
+	// Pools are aligned to their size, so it has to be a power of 2
+	size_t spot = sizeof(Particle) + sizeof(atomic<unsigned>);
+	pool_bytes = 4096;
+	while (pool_bytes < sizeof(PoolHeader) + pool_size * spot + alignof(Particle))
+		pool_bytes <<= 1;
+	size_t links_end = sizeof(PoolHeader) + sizeof(atomic<unsigned>) * (pool_bytes / spot);
+	particles_offset = (links_end + alignof(Particle) - 1) / alignof(Particle) * alignof(Particle);
+	this->pool_size = static_cast<int>((pool_bytes - particles_offset) / sizeof(Particle));
+	for (auto & pool : pools)
+		pool.store(nullptr, memory_order_relaxed);
 }
 
-IParticle * System::Create()
+ConcurrentParticleAllocator::ConcurrentParticleAllocator(const Settings & s)
+	: ConcurrentParticleAllocator(static_cast<int>(1.2f * (s.ttl_max + s.ttl_min) / (s.emission_delay_max + s.emission_delay_min)))
+{}
+
+ConcurrentParticleAllocator::~ConcurrentParticleAllocator()
 {
-	Particle * new_particle = CreateInternal();
-	// Keeping the list linked
-	new_particle->next = first;
-	// Inserting new one at the start of the list
-	if (first)
-		first->prev = new_particle;
-	first = new_particle;
-	count++;
-	return first;
+	int count = min(pool_count.load(), static_cast<int>(MAX_POOLS));
+	for (int i = 0; i < count; i++) {
+#ifdef _MSC_VER
+		_aligned_free(pools[i].load());
+#else
+		free(pools[i].load());
+#endif
+	}
 }
 
-IParticle * System::Kill(IParticle * p)
+Particle * ConcurrentParticleAllocator::Create()
 {
-	if (!p)
+	unsigned index;
+	if (!Pop(&index, 1) && !AddPool(index))
 		return nullptr;
-	Particle * list_p = static_cast<Particle *>(p);
-	Particle * next_p = list_p->next;
-	Particle * prev_p = list_p->prev;
-	// Updating back links from the previous and the next neighbours
-	if (next_p)
-		next_p->prev = prev_p;
-	if (prev_p)
-		prev_p->next = next_p;
-	else // No previous particle means it's first in the list
-		first = next_p;
-	KillInternal(list_p);
-	count--;
-	return next_p;
+	Particle * res = GetParticle(index);
+	new (res) Particle();
+	return res;
 }
 
-IParticle * System::GetFirst()
+void ConcurrentParticleAllocator::Kill(Particle * p)
 {
-	return first;
+	unsigned index = GetIndex(p);
+	Push(&index, 1);
 }
 
-IParticle * System::GetEnd()
+int ConcurrentParticleAllocator::PoolCount() const
 {
-	return nullptr;
+	return min(pool_count.load(), static_cast<int>(MAX_POOLS));
 }
 
-IParticle * System::GetNext(IParticle * p)
+__forceinline Particle * ConcurrentParticleAllocator::GetParticle(unsigned index) const
 {
-	if (p)
-		return static_cast<Particle *>(p)->next;
-	else
-		return nullptr;
+	char * pool = reinterpret_cast<char *>(pools[index / pool_size].load(memory_order_acquire));
+	return reinterpret_cast<Particle *>(pool + particles_offset) + index % pool_size;
 }
 
-#ifdef __POOL_ALLOCATOR__
+__forceinline unsigned ConcurrentParticleAllocator::GetIndex(Particle * p) const
+{
+	uintptr_t address = reinterpret_cast<uintptr_t>(p);
+	PoolHeader * pool = reinterpret_cast<PoolHeader *>(address & ~(pool_bytes - 1));
+	Particle * first = reinterpret_cast<Particle *>(reinterpret_cast<char *>(pool) + particles_offset);
+	return static_cast<unsigned>(pool->index * pool_size + (p - first));
+}
 
-__forceinline Particle *System::CreateInternal()
+__forceinline atomic<unsigned> & ConcurrentParticleAllocator::Link(unsigned index) const
 {
-	return allocator.Create();
+	char * pool = reinterpret_cast<char *>(pools[index / pool_size].load(memory_order_acquire));
+	return reinterpret_cast<atomic<unsigned> *>(pool + sizeof(PoolHeader))[index % pool_size];
 }
 
-__forceinline void System::KillInternal(Particle *p)
+int ConcurrentParticleAllocator::Pop(unsigned * spots, int count)
 {
-	allocator.Kill(p);
+	unsigned long long old = top.load(memory_order_acquire);
+	for (;;) {
+		// Links may be changed by other threads while we walk them, but then the tag changes and CAS fails
+		int taken = 0;
+		unsigned next = static_cast<unsigned>(old);
+		while (taken < count && next) {
+			spots[taken++] = next - 1;
+			next = Link(next - 1).load(memory_order_relaxed);
+		}
+		if (!taken)
+			return 0;
+		unsigned long long desired = (((old >> 32) + 1) << 32) | next;
+		if (top.compare_exchange_weak(old, desired, memory_order_acq_rel, memory_order_acquire))
+			return taken;
+	}
+}
+
+void ConcurrentParticleAllocator::Push(const unsigned * spots, int count)
+{
+	// Chain the spots together first, only the last link depends on the current top
+	for (int i = 0; i < count - 1; i++)
+		Link(spots[i]).store(spots[i + 1] + 1, memory_order_relaxed);
+	atomic<unsigned> & last = Link(spots[count - 1]);
+	unsigned long long old = top.load(memory_order_relaxed);
+	unsigned long long desired;
+	do {
+		last.store(static_cast<unsigned>(old), memory_order_relaxed);
+		desired = (((old >> 32) + 1) << 32) | (spots[0] + 1);
+	} while (!top.compare_exchange_weak(old, desired, memory_order_release, memory_order_relaxed));
 }
 
+bool ConcurrentParticleAllocator::AddPool(unsigned & spot)
+{
+	// Several threads may find the stack empty at once and each add a pool, that only costs some memory
+	int index = pool_count.load();
+	do {
+		if (index >= MAX_POOLS)
+			return false;
+	} while (!pool_count.compare_exchange_weak(index, index + 1));
+#ifdef _MSC_VER
+	void * memory = _aligned_malloc(pool_bytes, pool_bytes);
 #else
+	void * memory = aligned_alloc(pool_bytes, pool_bytes);
+#endif
+	// Index stays taken by an empty slot, none of its spots ever gets on the stack
+	if (!memory)
+		return false;
+	PoolHeader * pool = new (memory) PoolHeader{ index };
+	unsigned first = static_cast<unsigned>(index * pool_size);
+	// Link the whole pool into a chain before publishing it with a single CAS
+	atomic<unsigned> * links = reinterpret_cast<atomic<unsigned> *>(reinterpret_cast<char *>(pool) + sizeof(PoolHeader));
+	for (int i = 0; i < pool_size - 1; i++)
+		new (links + i) atomic<unsigned>(first + i + 2);
+	new (links + pool_size - 1) atomic<unsigned>(0);
+	pools[index].store(pool, memory_order_release);
+	if (pool_size > 1) {
+		atomic<unsigned> & last = links[pool_size - 1];
+		unsigned long long old = top.load(memory_order_relaxed);
+		unsigned long long desired;
+		do {
+			last.store(static_cast<unsigned>(old), memory_order_relaxed);
+			desired = (((old >> 32) + 1) << 32) | (first + 2);
+		} while (!top.compare_exchange_weak(old, desired, memory_order_release, memory_order_relaxed));
+	}
+	// The first spot goes to the caller
+	spot = first;
+	return true;
+}
 
-__forceinline Particle *System::CreateInternal()
+ConcurrentParticleAllocator::Magazine::Magazine(ConcurrentParticleAllocator & allocator)
+	: allocator(allocator)
+{}
+
+ConcurrentParticleAllocator::Magazine::~Magazine()
 {
-	return new Particle();	
+	if (count)
+		allocator.Push(spots, count);
 }
 
-__forceinline void System::KillInternal(Particle *p)
+Particle * ConcurrentParticleAllocator::Magazine::Create()
 {
-	delete p;
+	if (!count) {
+		count = allocator.Pop(spots, SIZE / 2);
+		if (!count) {
+			if (!allocator.AddPool(spots[0]))
+				return nullptr;
+			count = 1;
+		}
+	}
+	Particle * res = allocator.GetParticle(spots[--count]);
+	new (res) Particle();
+	return res;
 }
 
-#endif
+void ConcurrentParticleAllocator::Magazine::Kill(Particle * p)
+{
+	if (count == SIZE) {
+		// Return half, so alternating Create and Kill don't hit the shared stack every time
+		allocator.Push(spots + SIZE / 2, SIZE / 2);
+		count = SIZE / 2;
+	}
+	spots[count++] = allocator.GetIndex(p);
+}
 
 #pragma endregion
 
-#pragma region "StdSystem: Particle system based on std::list implementation"
+#pragma region "TimingWheel: Hierarchical timing wheel of particles bucketed by expiry tick"
 
-StdSystem::StdSystem(vec3 system_pos, const Settings & s) :
-	ISystem(system_pos, s)
-{}
+TimingWheel::TimingWheel(float tick) :
+	tick(tick)
+{
+	for (auto & slot : slots)
+		slot = nullptr;
+}
 
-ListIt StdSystem::Create()
+void TimingWheel::Add(Particle * p)
 {
-	list.emplace_front();
-	count++;
-	return list.begin();
+	// Ticks from the start of the current one until ttl runs out
+	float remaining = (elapsed + p->ttl) / tick;
+	if (!(remaining >= 2)) {
+		p->expiry = now;
+		Link(p, SOON);
+		return;
+	}
+	// A tick early, so rounding of ttl and wheel time never makes a particle late. Expiry is clamped to the range
+	// of the wheel, that's over 3 days at 60 ticks per second. A particle living longer is just looked at in between
+	p->expiry = now + (remaining < 0xFFFFFF ? static_cast<unsigned>(remaining) - 1 : 0xFFFFFF);
+	Insert(p);
 }
 
-ListIt StdSystem::Kill(ListIt p)
+void TimingWheel::Remove(Particle * p)
 {
-	count--;
-	return list.erase(p);
+	if (p->wheel_next)
+		p->wheel_next->wheel_prev = p->wheel_prev;
+	if (p->wheel_prev)
+		p->wheel_prev->wheel_next = p->wheel_next;
+	else
+		slots[p->wheel_slot] = p->wheel_next;
+	p->wheel_next = p->wheel_prev = nullptr;
+	p->expiry = 0;
 }
 
-ListIt StdSystem::GetFirst()
+template<typename F>
+void TimingWheel::Advance(float dt, F && f)
 {
-	return list.begin();
+	elapsed += dt;
+	while (elapsed >= tick) {
+		elapsed -= tick;
+		now++;
+		// When a level completes a turn, next slot of the level above is spread over the lower levels
+		for (int level = 1; level < LEVELS; level++) {
+			if (now & ((1u << (level * SLOT_BITS)) - 1))
+				break;
+			int slot = (now >> (level * SLOT_BITS)) & (SLOTS - 1);
+			for (Particle * p = Detach(level * SLOTS + slot); p; ) {
+				Particle * next = p->wheel_next;
+				Insert(p);
+				p = next;
+			}
+		}
+		Check(Detach(now & (SLOTS - 1)), f);
+	}
+	Check(Detach(SOON), f);
 }
 
-ListIt StdSystem::GetEnd()
+template<typename F>
+void TimingWheel::Check(Particle * chain, F & f)
 {
-	return list.end();
+	for (Particle * p = chain; p; ) {
+		Particle * next = p->wheel_next;
+		p->wheel_next = p->wheel_prev = nullptr;
+		p->expiry = 0;
+		if (p->ttl <= 0)
+			f(p);
+		else
+			Add(p);
+		p = next;
+	}
 }
 
-ListIt StdSystem::GetNext(ListIt p)
+void TimingWheel::Insert(Particle * p)
 {
-	p++;
-	return p;
+	unsigned delta = p->expiry > now ? p->expiry - now : 0;
+	int level = 0;
+	while (level < LEVELS - 1 && delta >= (1u << ((level + 1) * SLOT_BITS)))
+		level++;
+	Link(p, level * SLOTS + ((p->expiry >> (level * SLOT_BITS)) & (SLOTS - 1)));
 }
-#pragma endregion
\ No newline at end of file
+
+__forceinline void TimingWheel::Link(Particle * p, int slot)
+{
+	p->wheel_slot = slot;
+	p->wheel_prev = nullptr;
+	p->wheel_next = slots[slot];
+	if (slots[slot])
+		slots[slot]->wheel_prev = p;
+	slots[slot] = p;
+}
+
+__forceinline Particle * TimingWheel::Detach(int slot)
+{
+	Particle * res = slots[slot];
+	slots[slot] = nullptr;
+	return res;
+}
+
+#pragma endregion
+
+#pragma region "System: Particle system implementing an intrusive linked list"
+
+System::System(vec3 system_pos, const Settings & s) :
+	ISystem(system_pos, s),
+	first(nullptr),
+	allocator(s),
+	wheel(1.0f / 60)
+{
+
+}
+
+IParticle * System::Create()
+{
+	Particle * new_particle = CreateInternal();
+	// Keeping the list linked
+	new_particle->next = first;
+	// Inserting new one at the start of the list
+	if (first)
+		first->prev = new_particle;
+	first = new_particle;
+	// Its ttl is set by the caller, so it's checked at the next Finish and scheduled by then
+	wheel.Add(new_particle);
+	count++;
+	__PROFILE_COUNT(creates, 1);
+	return first;
+}
+
+IParticle * System::CreateBatch(int n)
+{
+	if (n <= 0)
+		return nullptr;
+	Particle * last;
+	Particle * chain = CreateChainInternal(n, last);
+	for (Particle * p = chain; p; p = p->next)
+		wheel.Add(p);
+	// Whole chain is inserted at the start of the list
+	last->next = first;
+	if (first)
+		first->prev = last;
+	first = chain;
+	count += n;
+	__PROFILE_COUNT(creates, n);
+	return first;
+}
+
+IParticle * System::Kill(IParticle * p)
+{
+	if (!p)
+		return nullptr;
+	Particle * list_p = static_cast<Particle *>(p);
+	Particle * next_p = list_p->next;
+	Particle * prev_p = list_p->prev;
+	// Updating back links from the previous and the next neighbours
+	if (next_p)
+		next_p->prev = prev_p;
+	if (prev_p)
+		prev_p->next = next_p;
+	else // No previous particle means it's first in the list
+		first = next_p;
+	if (defrag_placed == list_p)
+		defrag_placed = prev_p;
+	if (list_p->expiry)
+		wheel.Remove(list_p);
+	KillInternal(list_p);
+	count--;
+	__PROFILE_COUNT(kills, 1);
+	return next_p;
+}
+
+void System::Reschedule(IParticle * p)
+{
+	Particle * list_p = static_cast<Particle *>(p);
+	if (list_p->expiry)
+		wheel.Remove(list_p);
+	wheel.Add(list_p);
+}
+
+template<typename F>
+void System::ForEachChunk(F && f)
+{
+	Particle * p = first;
+	while (p) {
+		// Extend the run while the next particle lies right next to the current one, in either direction
+		Particle * run = p;
+		int step = p->next == p - 1 ? -1 : 1;
+		while (p->next == p + step)
+			p += step;
+		Particle * next = p->next;
+		if (step > 0)
+			f(ParticleChunk<Particle *>{ run, p + 1 });
+		else
+			f(ParticleChunk<Particle *>{ p, run + 1 });
+		p = next;
+	}
+}
+
+float System::Fragmentation() const
+{
+	if (count < 2)
+		return 0;
+	int jumps = 0;
+	for (Particle * p = first; p->next; p = p->next) {
+		if (p->next != p + 1)
+			jumps++;
+	}
+	return static_cast<float>(jumps) / (count - 1);
+}
+
+void System::Integrate(float dt)
+{
+	__PROFILE_TIME();
+	vector<RenderSnapshot::Attributes> * attributes = snapshot ? &snapshot->Back() : nullptr;
+	if (attributes)
+		attributes->clear();
+	ForEachChunk([this, dt, attributes](const ParticleChunk<Particle *> & chunk) {
+		for (auto & p : chunk) {
+			Move(p, acceleration, dt);
+			// Particles that are about to expire aren't worth drawing
+			if (attributes && p.ttl > 0)
+				attributes->push_back(RenderSnapshot::Attributes{ p.pos, p.ttl });
+		}
+	});
+}
+
+void System::Finish(float dt)
+{
+	{
+		__PROFILE_TIME();
+		wheel.Advance(dt, [this](Particle * p) { Kill(p); });
+#ifdef __POOL_ALLOCATOR__
+		// Pools for the next frames are allocated here rather than in the middle of emission
+		allocator.Maintain();
+#endif
+		if (snapshot)
+			snapshot->Publish();
+		// Built after kills, so the grid holds only live particles
+		if (grid) {
+			ForEachChunk([this](const ParticleChunk<Particle *> & chunk) {
+				for (auto & p : chunk)
+					grid->Add(&p);
+			});
+			grid->Rebuild();
+		}
+	}
+#ifdef __PARTICLES_PROFILE__
+	// Frame of this system is over
+	ParticleProfiler & profiler = ParticleProfiler::Instance();
+	profile.system = this;
+	profile.frame = profiler.Frame();
+	profile.live = count;
+	profile.pool_adds = allocator.GetStats().pools_added - pools_added;
+	pools_added = allocator.GetStats().pools_added;
+	profiler.Record(profile);
+	profile = ProfileSample();
+#endif
+}
+
+const ParticleAllocator::Stats & System::AllocatorStats() const
+{
+	return allocator.GetStats();
+}
+
+void System::EnableSnapshot()
+{
+	if (!snapshot)
+		snapshot.reset(new RenderSnapshot());
+}
+
+RenderSnapshot * System::Snapshot()
+{
+	return snapshot.get();
+}
+
+void System::EnableGrid(float cell_size)
+{
+	grid.reset(new ParticleGrid(cell_size));
+}
+
+const ParticleGrid * System::Grid() const
+{
+	return grid.get();
+}
+
+IParticle * System::GetFirst()
+{
+	return first;
+}
+
+IParticle * System::GetEnd()
+{
+	return nullptr;
+}
+
+IParticle * System::GetNext(IParticle * p)
+{
+	if (p)
+		return static_cast<Particle *>(p)->next;
+	else
+		return nullptr;
+}
+
+#ifdef __POOL_ALLOCATOR__
+
+void System::Trim()
+{
+	allocator.Trim();
+	// Memory under the sweep may be gone
+	defrag_cursor = nullptr;
+	defrag_placed = nullptr;
+}
+
+__forceinline Particle *System::CreateInternal()
+{
+	return allocator.Create();
+}
+
+__forceinline void System::KillInternal(Particle *p)
+{
+	allocator.Kill(p);
+}
+
+__forceinline Particle *System::CreateChainInternal(int n, Particle *& last)
+{
+	return allocator.CreateChain(n, last);
+}
+
+void System::Defragment(double budget_ms)
+{
+	auto deadline = chrono::steady_clock::now() + chrono::duration<double, milli>(budget_ms);
+	for (int step = 1; ; step++) {
+		// Take live particles in memory order and make each one follow the previously placed one in the list
+		Particle * p = allocator.NextLive(defrag_cursor);
+		if (!p) {
+			// Sweep is done, the next one starts from the lowest address
+			defrag_cursor = nullptr;
+			defrag_placed = nullptr;
+			return;
+		}
+		defrag_cursor = p + 1;
+		Particle * place = defrag_placed ? defrag_placed->next : first;
+		// Create puts particles at the head, before the placed ones, and Kill of the last placed one
+		// steps back onto its list neighbour. So the sweep can meet the placed one again, it stays where it is
+		if (p != place && p != defrag_placed) {
+			// Unlink
+			if (p->next)
+				p->next->prev = p->prev;
+			if (p->prev)
+				p->prev->next = p->next;
+			else
+				first = p->next;
+			// Insert after the placed one
+			p->prev = defrag_placed;
+			p->next = defrag_placed ? defrag_placed->next : first;
+			if (p->next)
+				p->next->prev = p;
+			if (defrag_placed)
+				defrag_placed->next = p;
+			else
+				first = p;
+		}
+		defrag_placed = p;
+		// Clock is checked once in a while, it's more expensive than a step
+		if (!(step & 63) && chrono::steady_clock::now() > deadline)
+			return;
+	}
+}
+
+#else
+
+void System::Trim()
+{}
+
+void System::Defragment(double)
+{}
+
+__forceinline Particle *System::CreateInternal()
+{
+	return new Particle();	
+}
+
+__forceinline void System::KillInternal(Particle *p)
+{
+	delete p;
+}
+
+__forceinline Particle *System::CreateChainInternal(int n, Particle *& last)
+{
+	Particle * head = new Particle();
+	last = head;
+	for (int i = 1; i < n; i++) {
+		Particle * p = new Particle();
+		p->prev = last;
+		last->next = p;
+		last = p;
+	}
+	return head;
+}
+
+#endif
+
+#pragma endregion
+
+#pragma region "StdSystem: Particle system based on std::list implementation"
+
+StdSystem::StdSystem(vec3 system_pos, const Settings & s) :
+	ISystem(system_pos, s)
+{}
+
+ListIt StdSystem::Create()
+{
+	list.emplace_front();
+	count++;
+	return list.begin();
+}
+
+ListIt StdSystem::CreateBatch(int n)
+{
+	// Nodes are built aside and spliced in one operation
+	std::list<IParticle> batch(max(n, 0));
+	list.splice(list.begin(), batch);
+	count += max(n, 0);
+	return list.begin();
+}
+
+ListIt StdSystem::Kill(ListIt p)
+{
+	count--;
+	return list.erase(p);
+}
+
+template<typename F>
+void StdSystem::ForEachChunk(F && f)
+{
+	// Nodes of std::list are never known to be adjacent, so it's a single linked run
+	f(ParticleChunk<ListIt>{ list.begin(), list.end() });
+}
+
+void StdSystem::Integrate(float dt)
+{
+	ForEachChunk([this, dt](const ParticleChunk<ListIt> & chunk) {
+		for (auto & p : chunk)
+			Move(p, acceleration, dt);
+	});
+}
+
+void StdSystem::Finish(float)
+{
+	for (ListIt p = list.begin(); p != list.end(); )
+		p = p->ttl <= 0 ? Kill(p) : GetNext(p);
+}
+
+ListIt StdSystem::GetFirst()
+{
+	return list.begin();
+}
+
+ListIt StdSystem::GetEnd()
+{
+	return list.end();
+}
+
+ListIt StdSystem::GetNext(ListIt p)
+{
+	p++;
+	return p;
+}
+#pragma endregion
+
+#pragma region "SoaSystem: Particle system storing particle fields in contiguous arrays"
+
+SoaSystem::SoaSystem(vec3 system_pos, const Settings & s) :
+	ISystem(system_pos, s)
+{}
+
+void SoaSystem::Get(int i, IParticle & p) const
+{
+	p.pos.x = pos_x[i];
+	p.pos.y = pos_y[i];
+	p.pos.z = pos_z[i];
+	p.vel.x = vel_x[i];
+	p.vel.y = vel_y[i];
+	p.vel.z = vel_z[i];
+	p.ttl = ttl[i];
+}
+
+void SoaSystem::Set(int i, const IParticle & p)
+{
+	pos_x[i] = p.pos.x;
+	pos_y[i] = p.pos.y;
+	pos_z[i] = p.pos.z;
+	vel_x[i] = p.vel.x;
+	vel_y[i] = p.vel.y;
+	vel_z[i] = p.vel.z;
+	ttl[i] = p.ttl;
+}
+
+void SoaSystem::Simulate(float dt)
+{
+	Integrate(dt);
+	Finish(dt);
+}
+
+template<typename F>
+void SoaSystem::ForEachChunk(F && f)
+{
+	for (int i = 0; i < count; i += CHUNK_SIZE) {
+		SoaChunk chunk = {
+			pos_x.data() + i, pos_y.data() + i, pos_z.data() + i,
+			vel_x.data() + i, vel_y.data() + i, vel_z.data() + i,
+			ttl.data() + i,
+			count - i < CHUNK_SIZE ? count - i : CHUNK_SIZE
+		};
+		f(chunk);
+	}
+}
+
+int SoaSystem::SplitCount()
+{
+	return count;
+}
+
+void SoaSystem::Integrate(float dt)
+{
+	IntegrateRange(dt, 0, count);
+}
+
+void SoaSystem::Finish(float)
+{
+	KillExpired();
+}
+
+int SoaSystem::Create()
+{
+	pos_x.push_back(0); pos_y.push_back(0); pos_z.push_back(0);
+	vel_x.push_back(0); vel_y.push_back(0); vel_z.push_back(0);
+	ttl.push_back(0);
+	return count++;
+}
+
+int SoaSystem::CreateBatch(int n)
+{
+	// Arrays grow once per batch and are zero filled in a tight loop
+	int res = count;
+	int size = count + max(n, 0);
+	pos_x.resize(size); pos_y.resize(size); pos_z.resize(size);
+	vel_x.resize(size); vel_y.resize(size); vel_z.resize(size);
+	ttl.resize(size);
+	count = size;
+	return res;
+}
+
+int SoaSystem::Kill(int p)
+{
+	// Swap and pop: the last particle takes the place of the killed one, so the next one to visit is at the same index
+	int last = --count;
+	pos_x[p] = pos_x[last]; pos_y[p] = pos_y[last]; pos_z[p] = pos_z[last];
+	vel_x[p] = vel_x[last]; vel_y[p] = vel_y[last]; vel_z[p] = vel_z[last];
+	ttl[p] = ttl[last];
+	pos_x.pop_back(); pos_y.pop_back(); pos_z.pop_back();
+	vel_x.pop_back(); vel_y.pop_back(); vel_z.pop_back();
+	ttl.pop_back();
+	return p;
+}
+
+int SoaSystem::GetFirst()
+{
+	return 0;
+}
+
+int SoaSystem::GetEnd()
+{
+	return count;
+}
+
+int SoaSystem::GetNext(int p)
+{
+	return p + 1;
+}
+
+void SoaSystem::IntegrateRange(float dt, int begin, int end)
+{
+#ifdef __AVX2__
+	IntegrateAvx2(dt, begin, end);
+#else
+	IntegrateScalar(dt, begin, end);
+#endif
+}
+
+void SoaSystem::IntegrateScalar(float dt, int begin, int end)
+{
+	float ax = acceleration.x * dt, ay = acceleration.y * dt, az = acceleration.z * dt;
+	// Plain loops over separate arrays, so compiler is free to vectorize them on its own
+	for (int i = begin; i < end; i++) {
+		vel_x[i] += ax;
+		vel_y[i] += ay;
+		vel_z[i] += az;
+		pos_x[i] += vel_x[i] * dt;
+		pos_y[i] += vel_y[i] * dt;
+		pos_z[i] += vel_z[i] * dt;
+		ttl[i] -= dt;
+	}
+}
+
+#ifdef __AVX2__
+
+void SoaSystem::IntegrateAvx2(float dt, int begin, int end)
+{
+	const int WIDTH = 8;
+	__m256 vdt = _mm256_set1_ps(dt);
+	__m256 ax = _mm256_set1_ps(acceleration.x * dt);
+	__m256 ay = _mm256_set1_ps(acceleration.y * dt);
+	__m256 az = _mm256_set1_ps(acceleration.z * dt);
+	float *px = pos_x.data(), *py = pos_y.data(), *pz = pos_z.data();
+	float *vx = vel_x.data(), *vy = vel_y.data(), *vz = vel_z.data();
+	float *t = ttl.data();
+	int i = begin;
+	for (; i + WIDTH <= end; i += WIDTH) {
+		__m256 x = _mm256_add_ps(_mm256_loadu_ps(vx + i), ax);
+		__m256 y = _mm256_add_ps(_mm256_loadu_ps(vy + i), ay);
+		__m256 z = _mm256_add_ps(_mm256_loadu_ps(vz + i), az);
+		_mm256_storeu_ps(vx + i, x);
+		_mm256_storeu_ps(vy + i, y);
+		_mm256_storeu_ps(vz + i, z);
+		_mm256_storeu_ps(px + i, _mm256_add_ps(_mm256_loadu_ps(px + i), _mm256_mul_ps(x, vdt)));
+		_mm256_storeu_ps(py + i, _mm256_add_ps(_mm256_loadu_ps(py + i), _mm256_mul_ps(y, vdt)));
+		_mm256_storeu_ps(pz + i, _mm256_add_ps(_mm256_loadu_ps(pz + i), _mm256_mul_ps(z, vdt)));
+		_mm256_storeu_ps(t + i, _mm256_sub_ps(_mm256_loadu_ps(t + i), vdt));
+	}
+	// Remainder that doesn't fill a whole register
+	IntegrateScalar(dt, i, end);
+}
+
+#endif
+
+void SoaSystem::KillExpired()
+{
+	// Going backwards means a particle moved in by Kill has already been checked
+	int i = count - 1;
+#ifdef __AVX2__
+	const int WIDTH = 8;
+	__m256 zero = _mm256_setzero_ps();
+	// Skip whole blocks of live particles with a single comparison
+	for (; i - WIDTH + 1 >= 0; i -= WIDTH) {
+		int first = i - WIDTH + 1;
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(ttl.data() + first), zero, _CMP_LE_OQ));
+		for (int bit = WIDTH - 1; mask && bit >= 0; bit--)
+			if (mask & (1 << bit))
+				Kill(first + bit);
+	}
+#endif
+	for (; i >= 0; i--)
+		if (ttl[i] <= 0)
+			Kill(i);
+}
+
+#pragma endregion
+
+#pragma region "ParticleScheduler: Work-stealing thread pool updating particle systems"
+
+ParticleScheduler::ParticleScheduler(int threads)
+{
+	if (threads <= 0)
+		threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+	for (int i = 0; i < threads; i++)
+		queues.emplace_back(new Queue());
+	// Calling thread is a worker too, so one less thread is needed
+	for (int i = 0; i < threads - 1; i++)
+		workers.emplace_back(&ParticleScheduler::WorkerLoop, this, i);
+}
+
+ParticleScheduler::~ParticleScheduler()
+{
+	{
+		lock_guard<mutex> guard(wake_lock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (auto & w : workers)
+		w.join();
+}
+
+void ParticleScheduler::Update(const vector<ISimulation *> & systems, float dt)
+{
+	int n = static_cast<int>(systems.size());
+	if (n > counters_size) {
+		counters.reset(new atomic<int>[n]);
+		counters_size = n;
+	}
+	// Jobs counter has to be set before any job becomes visible to workers
+	int jobs = 0;
+	for (int i = 0; i < n; i++) {
+		int size = systems[i]->SplitCount();
+		int ranges = size > RANGE_SIZE ? (size + RANGE_SIZE - 1) / RANGE_SIZE : 1;
+		counters[i].store(ranges);
+		jobs += ranges;
+	}
+	pending.store(jobs);
+	// Deal jobs round robin, stealing takes care of the imbalance
+	int queue = 0;
+	int queue_count = static_cast<int>(queues.size());
+	for (int i = 0; i < n; i++) {
+		int size = systems[i]->SplitCount();
+		if (size > RANGE_SIZE) {
+			for (int begin = 0; begin < size; begin += RANGE_SIZE) {
+				Push(queue++ % queue_count, Job{ systems[i], dt, begin, min(begin + RANGE_SIZE, size), &counters[i] });
+			}
+		}
+		else {
+			Push(queue++ % queue_count, Job{ systems[i], dt, 0, 0, nullptr });
+		}
+	}
+	{
+		lock_guard<mutex> guard(wake_lock);
+		generation++;
+	}
+	wake.notify_all();
+	RunJobs(queue_count - 1);
+	unique_lock<mutex> guard(wake_lock);
+	done.wait(guard, [this] { return pending.load() == 0; });
+}
+
+void ParticleScheduler::WorkerLoop(int index)
+{
+	int seen = 0;
+	for (;;) {
+		{
+			unique_lock<mutex> guard(wake_lock);
+			wake.wait(guard, [&] { return stop || generation != seen; });
+			if (stop)
+				return;
+			seen = generation;
+		}
+		RunJobs(index);
+	}
+}
+
+void ParticleScheduler::RunJobs(int index)
+{
+	Job job;
+	while (pending.load() > 0 && (Pop(index, job) || Steal(index, job))) {
+		Execute(job);
+		if (pending.fetch_sub(1) == 1) {
+			lock_guard<mutex> guard(wake_lock);
+			done.notify_all();
+		}
+	}
+}
+
+void ParticleScheduler::Execute(const Job & job)
+{
+	if (!job.ranges_left) {
+		job.sim->Integrate(job.dt);
+		job.sim->Finish(job.dt);
+	}
+	else {
+		job.sim->IntegrateRange(job.dt, job.begin, job.end);
+		// Whoever integrates the last range of a system finishes it
+		if (job.ranges_left->fetch_sub(1) == 1)
+			job.sim->Finish(job.dt);
+	}
+}
+
+bool ParticleScheduler::Pop(int index, Job & job)
+{
+	Queue & q = *queues[index];
+	lock_guard<mutex> guard(q.lock);
+	if (q.jobs.empty())
+		return false;
+	job = q.jobs.back();
+	q.jobs.pop_back();
+	return true;
+}
+
+bool ParticleScheduler::Steal(int index, Job & job)
+{
+	int count = static_cast<int>(queues.size());
+	for (int i = 1; i < count; i++) {
+		Queue & q = *queues[(index + i) % count];
+		lock_guard<mutex> guard(q.lock);
+		if (!q.jobs.empty()) {
+			job = q.jobs.front();
+			q.jobs.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ParticleScheduler::Push(int index, const Job & job)
+{
+	Queue & q = *queues[index];
+	lock_guard<mutex> guard(q.lock);
+	q.jobs.push_back(job);
+}
+
+#pragma endregion
+
+#pragma region "RenderSnapshot: Triple-buffered render attributes"
+
+vector<RenderSnapshot::Attributes> & RenderSnapshot::Back()
+{
+	return buffers[back];
+}
+
+void RenderSnapshot::Publish()
+{
+	back = latest.exchange(back | FRESH, memory_order_acq_rel) & ~FRESH;
+}
+
+const vector<RenderSnapshot::Attributes> & RenderSnapshot::Acquire()
+{
+	// Without a new frame the renderer keeps the one it has
+	if (latest.load(memory_order_acquire) & FRESH)
+		front = latest.exchange(front, memory_order_acq_rel) & ~FRESH;
+	return buffers[front];
+}
+
+#pragma endregion
+
+#pragma region "ParticleGrid: Spatial hash for neighbour and volume queries"
+
+ParticleGrid::ParticleGrid(float cell_size, int bucket_bits) :
+	inv_cell_size(1 / cell_size),
+	bucket_count(1 << bucket_bits),
+	starts(bucket_count + 1, 0)
+{}
+
+void ParticleGrid::Add(IParticle * p)
+{
+	pending.push_back(Item{ p, p->pos });
+	pending_buckets.push_back(Bucket(Cell(p->pos.x), Cell(p->pos.y), Cell(p->pos.z)));
+}
+
+void ParticleGrid::Rebuild()
+{
+	// Counting sort: count items per bucket, turn counts into offsets, then scatter
+	fill(starts.begin(), starts.end(), 0);
+	for (unsigned bucket : pending_buckets)
+		starts[bucket + 1]++;
+	for (int i = 1; i <= bucket_count; i++)
+		starts[i] += starts[i - 1];
+	items.resize(pending.size());
+	vector<int> & next = starts; // Filling moves each start forward, it's restored below
+	int count = static_cast<int>(pending.size());
+	for (int i = 0; i < count; i++)
+		items[next[pending_buckets[i]]++] = pending[i];
+	// Every start now points at the next bucket's start, shift them back
+	for (int i = bucket_count; i > 0; i--)
+		starts[i] = starts[i - 1];
+	starts[0] = 0;
+	pending.clear();
+	pending_buckets.clear();
+}
+
+template<typename F>
+void ParticleGrid::QueryRadius(const vec3 & center, float radius, F && f) const
+{
+	vec3 min(center.x - radius, center.y - radius, center.z - radius);
+	vec3 max(center.x + radius, center.y + radius, center.z + radius);
+	float r2 = radius * radius;
+	VisitCells(min, max, [&](const Item & item) {
+		float dx = item.pos.x - center.x, dy = item.pos.y - center.y, dz = item.pos.z - center.z;
+		if (dx * dx + dy * dy + dz * dz <= r2)
+			f(item.p);
+	});
+}
+
+template<typename F>
+void ParticleGrid::QueryBox(const vec3 & min, const vec3 & max, F && f) const
+{
+	VisitCells(min, max, [&](const Item & item) {
+		if (item.pos.x >= min.x && item.pos.x <= max.x && item.pos.y >= min.y && item.pos.y <= max.y
+			&& item.pos.z >= min.z && item.pos.z <= max.z)
+			f(item.p);
+	});
+}
+
+template<typename F>
+void ParticleGrid::VisitCells(const vec3 & min, const vec3 & max, F && f) const
+{
+	int x0 = Cell(min.x), y0 = Cell(min.y), z0 = Cell(min.z);
+	int x1 = Cell(max.x), y1 = Cell(max.y), z1 = Cell(max.z);
+	long long cells = (long long)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+	if (cells >= bucket_count) {
+		// Box covers more cells than there are buckets, all items have to be checked anyway
+		for (auto & item : items)
+			f(item);
+		return;
+	}
+	// Different cells may share a bucket, so buckets are deduplicated first
+	vector<unsigned> & buckets = query_buckets;
+	buckets.clear();
+	for (int x = x0; x <= x1; x++)
+		for (int y = y0; y <= y1; y++)
+			for (int z = z0; z <= z1; z++)
+				buckets.push_back(Bucket(x, y, z));
+	sort(buckets.begin(), buckets.end());
+	buckets.erase(unique(buckets.begin(), buckets.end()), buckets.end());
+	for (unsigned bucket : buckets)
+		for (int i = starts[bucket]; i < starts[bucket + 1]; i++)
+			f(items[i]);
+}
+
+__forceinline int ParticleGrid::Cell(float v) const
+{
+	// Cast of a float out of int range is undefined. Limit also keeps the cell count of a box within long long
+	float cell = floorf(v * inv_cell_size);
+	if (!(cell > -CELL_LIMIT))
+		return -CELL_LIMIT;
+	if (cell > CELL_LIMIT)
+		return CELL_LIMIT;
+	return static_cast<int>(cell);
+}
+
+__forceinline unsigned ParticleGrid::Bucket(int x, int y, int z) const
+{
+	return (static_cast<unsigned>(x) * 73856093u ^ static_cast<unsigned>(y) * 19349663u ^ static_cast<unsigned>(z) * 83492791u) & (bucket_count - 1);
+}
+
+#pragma endregion
+
+#ifdef __PARTICLES_PROFILE__
+
+#pragma region "ParticleProfiler: Per-frame profiling counters and histograms"
+
+void Histogram::Add(double value)
+{
+	int bucket = 0;
+	for (double limit = 1; value >= limit && bucket < BUCKETS - 1; limit *= 2)
+		bucket++;
+	buckets[bucket]++;
+}
+
+ParticleProfiler & ParticleProfiler::Instance()
+{
+	static ParticleProfiler profiler;
+	return profiler;
+}
+
+ParticleProfiler::ParticleProfiler() :
+	start(chrono::steady_clock::now()),
+	samples(MAX_SAMPLES),
+	frames(MAX_FRAMES)
+{}
+
+ParticleProfiler::ThreadBuffer & ParticleProfiler::LocalBuffer()
+{
+	thread_local ThreadBuffer * local = nullptr;
+	if (!local) {
+		lock_guard<mutex> guard(registry_lock);
+		buffers.emplace_back(new ThreadBuffer());
+		local = buffers.back().get();
+		local->thread = static_cast<int>(buffers.size());
+	}
+	return *local;
+}
+
+void ParticleProfiler::Record(const ProfileSample & sample)
+{
+	ThreadBuffer & buffer = LocalBuffer();
+	buffer.samples.push_back(sample);
+	buffer.samples.back().thread = buffer.thread;
+}
+
+void ParticleProfiler::EndFrame()
+{
+	FrameProfile totals;
+	totals.frame = frame;
+	totals.end = Now();
+	lock_guard<mutex> guard(registry_lock);
+	for (auto & buffer : buffers) {
+		for (auto & sample : buffer->samples) {
+			totals.systems++;
+			totals.creates += sample.creates;
+			totals.kills += sample.kills;
+			totals.live += sample.live;
+			totals.pool_adds += sample.pool_adds;
+			totals.update_time.Add(sample.update);
+			totals.live_count.Add(sample.live);
+			samples.Add(sample);
+		}
+		buffer->samples.clear();
+	}
+	frames.Add(totals);
+	frame++;
+}
+
+bool ParticleProfiler::Export(const char * filename) const
+{
+	FILE * out = fopen(filename, "w");
+	if (!out)
+		return false;
+	fprintf(out, "{\"traceEvents\":[\n");
+	bool comma = false;
+	samples.ForEach([out, &comma](const ProfileSample & s) {
+		fprintf(out, "%s{\"name\":\"System %p\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"frame\":%d,\"creates\":%d,\"kills\":%d,\"live\":%d,\"pool_adds\":%d}}\n",
+			comma ? "," : "", s.system, s.thread, s.begin, s.update, s.frame, s.creates, s.kills, s.live, s.pool_adds);
+		comma = true;
+	});
+	frames.ForEach([out, &comma](const FrameProfile & f) {
+		fprintf(out, "%s{\"name\":\"particles\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+			"\"args\":{\"systems\":%d,\"creates\":%d,\"kills\":%d,\"live\":%d,\"pool_adds\":%d}}\n",
+			comma ? "," : "", f.end, f.systems, f.creates, f.kills, f.live, f.pool_adds);
+		comma = true;
+	});
+	fprintf(out, "]}\n");
+	fclose(out);
+	return true;
+}
+
+vector<FrameProfile> ParticleProfiler::Frames() const
+{
+	vector<FrameProfile> res;
+	frames.ForEach([&res](const FrameProfile & f) { res.push_back(f); });
+	return res;
+}
+
+double ParticleProfiler::Now() const
+{
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+int ParticleProfiler::Frame() const
+{
+	return frame;
+}
+
+ProfileTimer::ProfileTimer(ProfileSample & sample) :
+	sample(sample),
+	begin(ParticleProfiler::Instance().Now())
+{
+	// First timed scope of the frame marks where the system's work starts
+	if (!sample.update)
+		sample.begin = begin;
+}
+
+ProfileTimer::~ProfileTimer()
+{
+	sample.update += ParticleProfiler::Instance().Now() - begin;
+}
+
+#pragma endregion
+
+#endif
+
+#ifdef __PARTICLES_BENCH__
+
+#pragma region "Benchmarks"
+
+// Threads create and kill particles in a shared allocator, each keeping a window of live particles.
+// Prints millions of operations per second for every thread count, with and without per-thread magazines
+void BenchmarkConcurrentAllocator(int max_threads, int ops_per_thread)
+{
+	const int WINDOW = 256;
+	printf("threads, shared Mops/s, magazine Mops/s\n");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		double rates[2];
+		for (int mode = 0; mode < 2; mode++) {
+			ConcurrentParticleAllocator allocator(10000);
+			vector<thread> workers;
+			atomic<long long> done{ 0 };
+			auto start = chrono::steady_clock::now();
+			for (int t = 0; t < threads; t++) {
+				workers.emplace_back([&allocator, &done, mode, ops_per_thread]() {
+					ConcurrentParticleAllocator::Magazine magazine(allocator);
+					Particle * window[WINDOW] = {};
+					int i = 0;
+					for (; i < ops_per_thread; i++) {
+						Particle *& slot = window[i % WINDOW];
+						if (slot) {
+							if (mode)
+								magazine.Kill(slot);
+							else
+								allocator.Kill(slot);
+						}
+						slot = mode ? magazine.Create() : allocator.Create();
+						// Pool table is full, the thread stops and only its finished operations count
+						if (!slot)
+							break;
+						slot->ttl = 1;
+					}
+					done += i;
+					for (auto p : window)
+						if (p) {
+							if (mode)
+								magazine.Kill(p);
+							else
+								allocator.Kill(p);
+						}
+				});
+			}
+			for (auto & w : workers)
+				w.join();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			// Create and Kill are counted as separate operations
+			rates[mode] = 2.0 * done / seconds / 1e6;
+		}
+		printf("%d, %.1f, %.1f\n", threads, rates[0], rates[1]);
+	}
+}
+
+// Churns a long-lived system with random creations and kills, then compares update time before and after defragmentation
+void BenchmarkDefragment(int particles, int frames)
+{
+	struct BenchSystem : public System {
+		using System::System;
+		using System::Create;
+		using System::Kill;
+		using System::GetFirst;
+		using System::GetNext;
+	};
+	Settings s = {};
+	s.emission_delay_min = s.emission_delay_max = 1;
+	s.ttl_min = s.ttl_max = static_cast<float>(particles);
+	BenchSystem sys(vec3(), s);
+	unsigned seed = 1;
+	for (int i = 0; i < particles * 2; i++) {
+		seed = seed * 1103515245 + 12345;
+		if (sys.GetFirst() && (seed >> 16) % 4 == 0) {
+			// Kill someone near the head, list order soon stops matching memory order
+			IParticle * p = sys.GetFirst();
+			for (int skip = (seed >> 8) % 16; skip && sys.GetNext(p); skip--)
+				p = sys.GetNext(p);
+			sys.Kill(p);
+		}
+		else
+			sys.Create()->ttl = 1e9f;
+	}
+	auto measure = [&]() {
+		auto start = chrono::steady_clock::now();
+		for (int f = 0; f < frames; f++)
+			sys.Integrate(0.001f);
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / frames;
+	};
+	float before_frag = sys.Fragmentation();
+	double before = measure();
+	sys.Defragment(1e9);
+	printf("particles, fragmentation before, after, update ms before, after\n");
+	printf("%d, %.3f, %.3f, %.3f, %.3f\n", sys.Count(), before_frag, sys.Fragmentation(), before, measure());
+}
+
+// Scripted emission for benchmarks
+struct BenchProfile
+{
+	const char * name;
+	Settings settings;
+	int systems;
+	int burst_period; // Frames between bursts, 0 for none
+	int burst_size;
+};
+
+// Resident memory of the process in KB, 0 where it isn't known
+size_t ResidentMemory()
+{
+#ifdef __linux__
+	size_t total = 0, resident = 0;
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%zu %zu", &total, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+	return 0;
+#endif
+}
+
+__forceinline float BenchRandom(unsigned & seed, float min, float max)
+{
+	seed = seed * 1103515245 + 12345;
+	return min + (max - min) * ((seed >> 8) & 0xFFFF) / 65535.0f;
+}
+
+// Prints 50th, 90th, 99th percentiles and maximum of frame times in microseconds
+void PrintPercentiles(vector<double> & times)
+{
+	sort(times.begin(), times.end());
+	size_t n = times.size();
+	printf("%.1f, %.1f, %.1f, %.1f", times[n / 2], times[n * 9 / 10], times[n * 99 / 100], times[n - 1]);
+}
+
+// Emits particles into systems of type S according to the profile, measuring each phase of every frame
+template<typename S>
+void RunProfile(const BenchProfile & profile, const char * system_name, int frames)
+{
+	struct Emitter : public S {
+		using S::S;
+		using S::Create;
+		float timer{ 0 };
+	};
+	const float dt = 1.0f / 60;
+	const Settings & s = profile.settings;
+	size_t base_memory = ResidentMemory();
+	size_t peak_memory = base_memory;
+	vector<double> create_times, update_times, kill_times;
+	{
+		vector<unique_ptr<Emitter>> systems;
+		for (int i = 0; i < profile.systems; i++)
+			systems.emplace_back(new Emitter(vec3(), s));
+		unsigned seed = 1;
+		for (int frame = 0; frame < frames; frame++) {
+			auto start = chrono::steady_clock::now();
+			for (auto & sys : systems) {
+				int n = profile.burst_period && frame % profile.burst_period == 0 ? profile.burst_size : 0;
+				for (sys->timer -= dt; sys->timer <= 0; sys->timer += BenchRandom(seed, s.emission_delay_min, s.emission_delay_max))
+					n++;
+				for (; n > 0; n--) {
+					auto p = sys->Create();
+					p->ttl = BenchRandom(seed, s.ttl_min, s.ttl_max);
+					p->vel.x = BenchRandom(seed, -1, 1);
+					p->vel.y = BenchRandom(seed, 0, 5);
+				}
+			}
+			auto created = chrono::steady_clock::now();
+			for (auto & sys : systems)
+				sys->Integrate(dt);
+			auto updated = chrono::steady_clock::now();
+			for (auto & sys : systems)
+				sys->Finish(dt);
+			auto killed = chrono::steady_clock::now();
+			create_times.push_back(chrono::duration<double, micro>(created - start).count());
+			update_times.push_back(chrono::duration<double, micro>(updated - created).count());
+			kill_times.push_back(chrono::duration<double, micro>(killed - updated).count());
+			peak_memory = max(peak_memory, ResidentMemory());
+		}
+	}
+#ifdef __linux__
+	// Give freed memory back, so the next run starts from the same baseline
+	malloc_trim(0);
+#endif
+	printf("%s, %s, ", profile.name, system_name);
+	PrintPercentiles(create_times);
+	printf(", ");
+	PrintPercentiles(update_times);
+	printf(", ");
+	PrintPercentiles(kill_times);
+	printf(", %zu\n", peak_memory - base_memory);
+}
+
+// Runs every profile with every list-based system. Build once more with __NO_POOL_ALLOCATOR__ to get System without pools
+void BenchmarkProfiles(int frames)
+{
+	BenchProfile profiles[4];
+	profiles[0].name = "steady";
+	profiles[0].settings.emission_delay_min = 0.0004f;
+	profiles[0].settings.emission_delay_max = 0.0006f;
+	profiles[0].settings.ttl_min = 1;
+	profiles[0].settings.ttl_max = 2;
+	profiles[0].systems = 1;
+	profiles[0].burst_period = 0;
+	profiles[0].burst_size = 0;
+
+	profiles[1] = profiles[0];
+	profiles[1].name = "bursty";
+	profiles[1].settings.emission_delay_min = 0.005f;
+	profiles[1].settings.emission_delay_max = 0.01f;
+	profiles[1].burst_period = 60;
+	profiles[1].burst_size = 20000;
+
+	profiles[2] = profiles[0];
+	profiles[2].name = "long-ttl";
+	profiles[2].settings.emission_delay_min = 0.001f;
+	profiles[2].settings.emission_delay_max = 0.002f;
+	profiles[2].settings.ttl_min = 20;
+	profiles[2].settings.ttl_max = 60;
+
+	profiles[3] = profiles[0];
+	profiles[3].name = "tiny-systems";
+	profiles[3].settings.emission_delay_min = 0.05f;
+	profiles[3].settings.emission_delay_max = 0.15f;
+	profiles[3].settings.ttl_min = 0.5f;
+	profiles[3].settings.ttl_max = 1;
+	profiles[3].systems = 5000;
+
+#ifdef __POOL_ALLOCATOR__
+	const char * system_name = "System (pool)";
+#else
+	const char * system_name = "System (new/delete)";
+#endif
+	printf("profile, system, create p50, p90, p99, max, update p50, p90, p99, max, kill p50, p90, p99, max (us), peak memory KB\n");
+	for (auto & profile : profiles) {
+		RunProfile<System>(profile, system_name, frames);
+		RunProfile<StdSystem>(profile, "StdSystem", frames);
+	}
+}
+
+// Everything at once, called by bench.cpp
+void RunParticleBenchmarks()
+{
+	BenchmarkProfiles(1200);
+	BenchmarkDefragment(200000, 20);
+	BenchmarkConcurrentAllocator(static_cast<int>(thread::hardware_concurrency()), 2000000);
+}
+
+#pragma endregion
+
+#endif
\ No newline at end of file
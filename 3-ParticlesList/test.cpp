@@ -0,0 +1,650 @@
+// Checks of my.cpp. Parts shared between threads are stressed on several threads and compared
+// with the same work done on one.
+// Build and run: g++ -std=c++17 -O2 -pthread test.cpp -o test && ./test
+
+#include "harness.h"
+#include "my.cpp"
+
+int failures = 0;
+
+void Check(bool ok, const char * what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		failures++;
+}
+
+// System with its protected interface opened for filling and reading back
+template<typename S>
+struct Open : public S
+{
+	using S::S;
+	using S::Create;
+	using S::Kill;
+	using S::GetFirst;
+	using S::GetEnd;
+	using S::GetNext;
+};
+
+__forceinline float TestRandom(unsigned & seed, float min, float max)
+{
+	seed = seed * 1103515245 + 12345;
+	return min + (max - min) * ((seed >> 8) & 0xFFFF) / 65535.0f;
+}
+
+void Randomize(IParticle & p, unsigned & seed)
+{
+	p.pos = vec3(TestRandom(seed, -1, 1), TestRandom(seed, -1, 1), TestRandom(seed, -1, 1));
+	p.vel = vec3(TestRandom(seed, -1, 1), TestRandom(seed, 0, 5), TestRandom(seed, -1, 1));
+	p.ttl = TestRandom(seed, 0.05f, 2);
+}
+
+template<typename S>
+vector<IParticle> Contents(S & s)
+{
+	vector<IParticle> res;
+	for (auto p = s.GetFirst(); p != s.GetEnd(); p = s.GetNext(p))
+		res.push_back(*p);
+	return res;
+}
+
+vector<IParticle> Contents(Open<SoaSystem> & s)
+{
+	vector<IParticle> res(s.Count());
+	for (int i = 0; i < s.Count(); i++)
+		s.Get(i, res[i]);
+	return res;
+}
+
+bool Same(const vector<IParticle> & a, const vector<IParticle> & b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		const IParticle & x = a[i], & y = b[i];
+		if (x.pos.x != y.pos.x || x.pos.y != y.pos.y || x.pos.z != y.pos.z || x.vel.x != y.vel.x
+			|| x.vel.y != y.vel.y || x.vel.z != y.vel.z || x.ttl != y.ttl)
+			return false;
+	}
+	return true;
+}
+
+#pragma region "ParticleScheduler"
+
+// Systems of every kind, big ones split into ranges, are updated by the scheduler and one by one
+void TestScheduler()
+{
+	const int SYSTEMS = 48;
+	const int FRAMES = 90;
+	const float dt = 1.0f / 60;
+	struct World {
+		vector<unique_ptr<Open<SoaSystem>>> soa;
+		vector<unique_ptr<Open<System>>> lists;
+		vector<unique_ptr<Open<StdSystem>>> std_lists;
+		vector<ISimulation *> all;
+
+		World()
+		{
+			Settings s;
+			unsigned seed = 7;
+			for (int i = 0; i < SYSTEMS; i++) {
+				int n = i % 8 ? 50 + i * 37 : 3 * ParticleScheduler::RANGE_SIZE + 100;
+				soa.emplace_back(new Open<SoaSystem>(vec3(), s));
+				soa.back()->acceleration = vec3(0, -9.8f, 0);
+				for (int j = 0; j < n; j++) {
+					IParticle p;
+					Randomize(p, seed);
+					soa.back()->Set(soa.back()->Create(), p);
+				}
+				all.push_back(soa.back().get());
+				if (i % 4)
+					continue;
+				lists.emplace_back(new Open<System>(vec3(), s));
+				std_lists.emplace_back(new Open<StdSystem>(vec3(), s));
+				for (int j = 0; j < n / 4; j++) {
+					IParticle p;
+					Randomize(p, seed);
+					*static_cast<IParticle *>(lists.back()->Create()) = p;
+					*std_lists.back()->Create() = p;
+				}
+				all.push_back(lists.back().get());
+				all.push_back(std_lists.back().get());
+			}
+		}
+	};
+	World parallel, serial;
+	{
+		ParticleScheduler scheduler(4);
+		for (int frame = 0; frame < FRAMES; frame++)
+			scheduler.Update(parallel.all, dt);
+	}
+	for (int frame = 0; frame < FRAMES; frame++)
+		for (ISimulation * sim : serial.all) {
+			sim->Integrate(dt);
+			sim->Finish(dt);
+		}
+	bool same = true;
+	for (int i = 0; i < SYSTEMS; i++)
+		same = same && Same(Contents(*parallel.soa[i]), Contents(*serial.soa[i]));
+	for (size_t i = 0; i < parallel.lists.size(); i++) {
+		same = same && Same(Contents(*parallel.lists[i]), Contents(*serial.lists[i]));
+		same = same && Same(Contents(*parallel.std_lists[i]), Contents(*serial.std_lists[i]));
+	}
+	Check(same, "scheduler on 4 threads gives the same particles as updating systems one by one");
+}
+
+#pragma endregion
+
+#pragma region "ConcurrentParticleAllocator"
+
+// Spots in a fresh allocator before it needs a second pool, counted on one thread
+int SpotsPerPool(int pool_size)
+{
+	ConcurrentParticleAllocator allocator(pool_size);
+	int spots = 0;
+	while (allocator.Create() && allocator.PoolCount() < 2)
+		spots++;
+	return spots;
+}
+
+// Threads create and kill particles through the shared stack and through magazines. Every particle is
+// stamped by its owner, so a spot handed to two threads at once is noticed. Afterwards every spot must be
+// free exactly once, as many as the pools hold when counted on one thread
+void TestConcurrentAllocator()
+{
+	const int THREADS = 4;
+	const int OPS = 200000;
+	const int WINDOW = 100;
+	const int POOL_SIZE = 1000;
+	ConcurrentParticleAllocator allocator(POOL_SIZE);
+	atomic<int> collisions{ 0 };
+	vector<thread> workers;
+	for (int t = 0; t < THREADS; t++) {
+		workers.emplace_back([&allocator, &collisions, t]() {
+			ConcurrentParticleAllocator::Magazine magazine(allocator);
+			Particle * window[WINDOW] = {};
+			float stamps[WINDOW] = {};
+			unsigned seed = t + 1;
+			for (int i = 0; i < OPS; i++) {
+				int slot = i % WINDOW;
+				bool shared = TestRandom(seed, 0, 1) < 0.3f;
+				if (window[slot]) {
+					if (window[slot]->ttl != stamps[slot])
+						collisions++;
+					if (shared)
+						allocator.Kill(window[slot]);
+					else
+						magazine.Kill(window[slot]);
+				}
+				window[slot] = shared ? allocator.Create() : magazine.Create();
+				stamps[slot] = static_cast<float>(t * OPS + i);
+				window[slot]->ttl = stamps[slot];
+			}
+			for (int slot = 0; slot < WINDOW; slot++) {
+				if (window[slot]->ttl != stamps[slot])
+					collisions++;
+				magazine.Kill(window[slot]);
+			}
+		});
+	}
+	for (auto & w : workers)
+		w.join();
+	Check(!collisions, "no spot is handed to two threads at once");
+
+	// Take every free spot, the first one from a new pool means the stack is empty
+	int pools = allocator.PoolCount();
+	vector<Particle *> taken;
+	for (Particle * p = allocator.Create(); p && allocator.PoolCount() == pools; p = allocator.Create())
+		taken.push_back(p);
+	sort(taken.begin(), taken.end());
+	bool unique_spots = adjacent_find(taken.begin(), taken.end()) == taken.end();
+	Check(unique_spots && static_cast<int>(taken.size()) == pools * SpotsPerPool(POOL_SIZE),
+		"every spot is free exactly once after all threads are done");
+
+	// Small pools run out of room in the pool table quickly
+	ConcurrentParticleAllocator small(1);
+	int created = 0;
+	while (small.Create())
+		created++;
+	Check(small.PoolCount() == ConcurrentParticleAllocator::MAX_POOLS && created == small.PoolCount() * SpotsPerPool(1),
+		"allocator returns nullptr once the pool table is full");
+}
+
+#pragma endregion
+
+#pragma region "System chunks"
+
+// Chunks must cover exactly the particles of the list, and runs of adjacent particles must come in one chunk
+void TestChunks()
+{
+	struct Chunks {
+		int count{ 0 };
+		int particles{ 0 };
+		vector<IParticle *> visited;
+	};
+	auto collect = [](Open<System> & sys) {
+		Chunks res;
+		sys.ForEachChunk([&res](const ParticleChunk<Particle *> & chunk) {
+			res.count++;
+			for (auto & p : chunk) {
+				res.particles++;
+				res.visited.push_back(&p);
+			}
+		});
+		sort(res.visited.begin(), res.visited.end());
+		return res;
+	};
+	auto listed = [](Open<System> & sys) {
+		vector<IParticle *> res;
+		for (IParticle * p = sys.GetFirst(); p != sys.GetEnd(); p = sys.GetNext(p))
+			res.push_back(p);
+		sort(res.begin(), res.end());
+		return res;
+	};
+	Settings s;
+	s.emission_delay_min = s.emission_delay_max = 0.001f;
+	s.ttl_min = s.ttl_max = 10; // 12000 particles in the first pool
+	Open<System> batch(vec3(), s);
+	batch.CreateBatch(1000);
+	Open<System> single(vec3(), s);
+	for (int i = 0; i < 1000; i++)
+		single.Create();
+	Chunks b = collect(batch), o = collect(single);
+#ifdef __POOL_ALLOCATOR__
+	Check(b.count == 1 && b.particles == 1000, "freshly created batch is a single chunk");
+	Check(o.count == 1 && o.particles == 1000, "particles created one by one are a single chunk");
+#endif
+	// Holes split runs, but every live particle is still visited once
+	unsigned seed = 3;
+	for (IParticle * p = single.GetFirst(); p; )
+		p = TestRandom(seed, 0, 1) < 0.2f ? single.Kill(p) : single.GetNext(p);
+	single.CreateBatch(300);
+	o = collect(single);
+	Check(o.visited == listed(single) && o.count > 1, "chunks of a list with holes visit every particle once");
+}
+
+#pragma endregion
+
+#pragma region "System defragmentation"
+
+// Walks the list both ways. It must hold exactly Count() particles, with back links matching
+bool Linked(Open<System> & sys)
+{
+	int n = 0;
+	Particle * prev = nullptr;
+	for (IParticle * p = sys.GetFirst(); p != sys.GetEnd() && n <= sys.Count(); p = sys.GetNext(p), n++) {
+		if (static_cast<Particle *>(p)->prev != prev)
+			return false;
+		prev = static_cast<Particle *>(p);
+	}
+	return n == sys.Count();
+}
+
+bool InMemoryOrder(Open<System> & sys)
+{
+	for (IParticle * p = sys.GetFirst(); p && sys.GetNext(p); p = sys.GetNext(p))
+		if (sys.GetNext(p) < p)
+			return false;
+	return true;
+}
+
+// Sweeps are interrupted by creations and kills, including of the particle the sweep placed last
+void TestDefragment()
+{
+	Settings s;
+	s.emission_delay_min = s.emission_delay_max = 0.001f;
+	s.ttl_min = s.ttl_max = 10;
+	// Fresh batch is in memory order, so a sweep of no time places the first 64 particles where they are
+	Open<System> sys(vec3(), s);
+	sys.CreateBatch(200);
+	vector<IParticle *> list;
+	for (IParticle * p = sys.GetFirst(); p; p = sys.GetNext(p))
+		list.push_back(p);
+	sys.Defragment(0);
+	// Only the last placed one is left of the placed ones. Spot the sweep continues from is freed
+	// and taken by a new particle at the head, then the last placed one dies too
+	for (int i = 0; i < 63; i++)
+		sys.Kill(list[i]);
+	sys.Kill(list[64]);
+	sys.Create();
+	sys.Kill(list[63]);
+	sys.Defragment(0);
+	Check(Linked(sys), "sweep meeting the particle it placed last keeps the list linked");
+	sys.Defragment(1000);
+	Check(Linked(sys), "interrupted sweep finishes with every particle in the list");
+#ifdef __POOL_ALLOCATOR__
+	Check(InMemoryOrder(sys), "finished sweep leaves the list in memory order");
+#endif
+
+	Open<System> churn(vec3(), s);
+	unsigned seed = 5;
+	bool linked = true;
+	for (int frame = 0; frame < 2000 && linked; frame++) {
+		int n = static_cast<int>(TestRandom(seed, 0, 30));
+		for (int i = 0; i < n; i++)
+			churn.Create();
+		if (frame % 10 == 0)
+			churn.CreateBatch(static_cast<int>(TestRandom(seed, 1, 100)));
+		for (IParticle * p = churn.GetFirst(); p; )
+			p = TestRandom(seed, 0, 1) < 0.1f ? churn.Kill(p) : churn.GetNext(p);
+		churn.Defragment(0);
+		linked = Linked(churn);
+	}
+	Check(linked, "sweeps between random creations and kills keep the list linked");
+	// Particles created at the head while the last sweep ran are put in order by a new one
+	churn.Defragment(1000);
+	churn.Defragment(1000);
+#ifdef __POOL_ALLOCATOR__
+	Check(Linked(churn) && InMemoryOrder(churn), "sweep after the churn leaves the list in memory order");
+#endif
+}
+
+#pragma endregion
+
+#pragma region "System allocator"
+
+// Pools emptied after a burst are released, the one holding live particles stays and they are left untouched
+void TestTrim()
+{
+#ifdef __POOL_ALLOCATOR__
+	Settings s;
+	s.emission_delay_min = s.emission_delay_max = 0.001f;
+	s.ttl_min = s.ttl_max = 1; // 1200 particles in the first pool
+	Open<System> sys(vec3(), s);
+	for (int i = 0; i < 100; i++)
+		sys.Create()->ttl = static_cast<float>(i + 1);
+	vector<IParticle> kept = Contents(sys);
+	IParticle * p = sys.CreateBatch(10000);
+	int burst_capacity = sys.AllocatorStats().capacity;
+	for (int i = 0; i < 10000; i++)
+		p = sys.Kill(p);
+	sys.Trim();
+	const ParticleAllocator::Stats & stats = sys.AllocatorStats();
+	Check(stats.capacity < burst_capacity && stats.capacity >= 100 && stats.live == 100,
+		"Trim releases pools emptied after a burst");
+	Check(Linked(sys) && Same(Contents(sys), kept), "Trim leaves live particles as they were");
+	sys.CreateBatch(5000);
+	for (int i = 0; i < 100; i++)
+		sys.Create();
+	Check(Linked(sys) && sys.AllocatorStats().live == 5200, "particles are created again after Trim");
+
+	for (p = sys.GetFirst(); p; )
+		p = sys.Kill(p);
+	sys.Trim();
+	sys.Trim();
+	Check(sys.AllocatorStats().capacity > 0 && sys.Create(), "Trim of an empty system keeps one pool");
+#endif
+}
+
+// Emission growing a little every frame is covered by pools Maintain adds between frames, a burst isn't
+void TestAdaptivePools()
+{
+#ifdef __POOL_ALLOCATOR__
+	Settings s;
+	s.emission_delay_min = s.emission_delay_max = 0.01f;
+	s.ttl_min = s.ttl_max = 1; // 120 particles in the first pool
+	Open<System> sys(vec3(), s);
+	sys.Create()->ttl = 100;
+	const ParticleAllocator::Stats & stats = sys.AllocatorStats();
+	Check(stats.pools_added == 1 && !stats.hot_adds, "first pool isn't counted as a hot add");
+	for (int frame = 1; frame <= 200; frame++) {
+		for (int i = 0; i < frame; i++)
+			sys.Create()->ttl = 100;
+		sys.Integrate(1.0f / 60);
+		sys.Finish(1.0f / 60);
+	}
+	Check(stats.pools_added > 1 && !stats.hot_adds && stats.capacity >= stats.live,
+		"Maintain grows pools ahead of steadily rising emission");
+	Check(stats.rate > 100 && stats.high_water == stats.live, "creation rate and high water mark follow emission");
+	int spare = stats.capacity - stats.live;
+	sys.CreateBatch(spare + 1000);
+	Check(stats.hot_adds == 1, "burst over the free spots adds a pool inside Create");
+#endif
+}
+
+// Batch comes first in the list, in one piece, with every particle cleared like one made by Create
+void TestCreateBatch()
+{
+	Settings s;
+	s.emission_delay_min = s.emission_delay_max = 0.001f;
+	s.ttl_min = s.ttl_max = 1;
+	Open<System> sys(vec3(), s);
+	Check(!sys.CreateBatch(0) && !sys.CreateBatch(-5) && !sys.Count(), "empty batch creates nothing");
+	unsigned seed = 9;
+	for (int i = 0; i < 50; i++)
+		Randomize(*sys.Create(), seed);
+	vector<IParticle> old = Contents(sys);
+	// Bigger than the first pool, so the batch is taken from several
+	const int N = 3000;
+	IParticle * batch = sys.CreateBatch(N);
+	bool cleared = true;
+	IParticle * p = batch;
+	for (int i = 0; i < N; i++, p = sys.GetNext(p))
+		cleared = cleared && p->ttl == 0 && p->pos.x == 0 && p->vel.y == 0;
+	vector<IParticle> rest;
+	for (; p; p = sys.GetNext(p))
+		rest.push_back(*p);
+	Check(batch == sys.GetFirst() && sys.Count() == N + 50 && Linked(sys), "batch is put at the head of the list");
+	Check(cleared && Same(rest, old), "batch particles are cleared and followed by the older ones");
+	// Killed in the first frame like particles from Create
+	sys.Finish(0.01f);
+	Check(sys.Count() == 50 && Linked(sys), "batch particles with no ttl die at the next Finish");
+}
+
+#pragma endregion
+
+#pragma region "System expiry"
+
+// System kills through its timing wheel, StdSystem checks every particle. Both must hold the same particles
+// after every frame, with frames shorter and longer than a wheel tick and ttl changed during particles' lives
+void TestExpiry()
+{
+	Settings s;
+	Open<System> wheel(vec3(), s);
+	Open<StdSystem> scan(vec3(), s);
+	unsigned seed = 11;
+	bool same = true;
+	for (int frame = 0; frame < 3000 && same; frame++) {
+		int n = static_cast<int>(TestRandom(seed, 0, 20));
+		IParticle init;
+		for (int i = 0; i < n; i++) {
+			Randomize(init, seed);
+			init.ttl = TestRandom(seed, 0, 1) < 0.1f ? TestRandom(seed, 0, 0.05f) : TestRandom(seed, 0.05f, 3);
+			*static_cast<IParticle *>(wheel.Create()) = init;
+			*scan.Create() = init;
+		}
+		if (frame % 50 == 0) {
+			Randomize(init, seed);
+			init.ttl = 1;
+			IParticle * batch = wheel.CreateBatch(100);
+			ListIt std_batch = scan.CreateBatch(100);
+			for (int i = 0; i < 100; i++, batch = wheel.GetNext(batch), std_batch++)
+				*batch = *std_batch = init;
+		}
+		if (frame % 7 == 0) {
+			// Change ttl of a few particles in the middle of their lives
+			IParticle * p = wheel.GetFirst();
+			ListIt q = scan.GetFirst();
+			for (int i = 0; p && i < 40; i++, p = wheel.GetNext(p), q++) {
+				if (i % 10)
+					continue;
+				float ttl = TestRandom(seed, 0, 4);
+				bool lower = ttl < p->ttl;
+				p->ttl = q->ttl = ttl;
+				if (lower)
+					wheel.Reschedule(p);
+			}
+		}
+		float dt = TestRandom(seed, 0.002f, 0.05f);
+		wheel.Integrate(dt);
+		wheel.Finish(dt);
+		scan.Integrate(dt);
+		scan.Finish(dt);
+		same = Same(Contents(wheel), Contents(scan));
+	}
+	Check(same, "particles in System die at the same frames as in StdSystem");
+}
+
+#pragma endregion
+
+#pragma region "RenderSnapshot"
+
+// Simulation thread publishes numbered frames, render thread acquires them at its own pace. Every acquired
+// buffer must hold one whole frame, frames never go back, and the last one published is the last one seen
+void TestSnapshot()
+{
+	const int FRAMES = 20000;
+	auto size_of = [](int frame) { return frame % 13 + 1; };
+	RenderSnapshot snapshot;
+	atomic<bool> finished{ false };
+	thread simulation([&]() {
+		for (int frame = 0; frame < FRAMES; frame++) {
+			vector<RenderSnapshot::Attributes> & back = snapshot.Back();
+			back.clear();
+			for (int i = 0; i < size_of(frame); i++)
+				back.push_back(RenderSnapshot::Attributes{ vec3(static_cast<float>(frame), 0, 0), static_cast<float>(frame) });
+			snapshot.Publish();
+			this_thread::yield(); // Let the renderer in between frames, otherwise it sees only the last few
+		}
+		finished = true;
+	});
+	int last = -1, torn = 0, backwards = 0, acquired = 0;
+	auto read = [&]() {
+		const vector<RenderSnapshot::Attributes> & front = snapshot.Acquire();
+		if (front.empty())
+			return;
+		int frame = static_cast<int>(front[0].ttl);
+		bool whole = static_cast<int>(front.size()) == size_of(frame);
+		for (auto & a : front)
+			whole = whole && a.ttl == frame && a.pos.x == frame;
+		torn += !whole;
+		backwards += frame < last;
+		acquired += frame != last;
+		last = frame;
+	};
+	while (!finished)
+		read();
+	simulation.join();
+	read();
+	Check(!torn && !backwards, "render thread only sees whole frames in publishing order");
+	Check(last == FRAMES - 1, "last acquired frame is the last published one");
+	printf("    %d of %d frames acquired\n", acquired, FRAMES);
+}
+
+#pragma endregion
+
+#pragma region "ParticleGrid"
+
+// Grid queries against checking every particle, with some particles far outside of int cell range
+void TestGrid()
+{
+	unsigned seed = 11;
+	vector<IParticle> particles(3000);
+	for (auto & p : particles) {
+		Randomize(p, seed);
+		p.pos = vec3(p.pos.x * 20, p.pos.y * 20, p.pos.z * 20);
+	}
+	particles[0].pos = vec3(1e30f, -1e30f, 0);
+	particles[1].pos = vec3(NAN, 0, 0);
+	ParticleGrid grid(0.5f, 10);
+	for (auto & p : particles)
+		grid.Add(&p);
+	grid.Rebuild();
+	int mismatches = 0;
+	for (int q = 0; q < 200; q++) {
+		vec3 center(TestRandom(seed, -25, 25), TestRandom(seed, -25, 25), TestRandom(seed, -25, 25));
+		float radius = TestRandom(seed, 0.1f, q % 10 ? 2.0f : 30.0f);
+		int found = 0, expected = 0;
+		grid.QueryRadius(center, radius, [&](IParticle *) { found++; });
+		for (auto & p : particles) {
+			float dx = p.pos.x - center.x, dy = p.pos.y - center.y, dz = p.pos.z - center.z;
+			expected += dx * dx + dy * dy + dz * dz <= radius * radius;
+		}
+		mismatches += found != expected;
+	}
+	Check(!mismatches, "radius queries find the same particles as a full scan");
+	int far = 0;
+	grid.QueryBox(vec3(1e29f, -2e30f, -1), vec3(2e30f, -1e29f, 1), [&](IParticle *) { far++; });
+	grid.QueryBox(vec3(NAN, NAN, NAN), vec3(NAN, NAN, NAN), [&](IParticle *) { far += 100; });
+	Check(far == 1, "far away and NaN boxes are clamped to the border cells");
+}
+
+#pragma endregion
+
+#pragma region "ParticleProfiler"
+
+// Frames sum up samples of all systems, export holds a trace event per kept sample and a counter per frame.
+// Build with -D__PARTICLES_PROFILE__ to run
+void TestProfiler()
+{
+#ifdef __PARTICLES_PROFILE__
+	ParticleProfiler & profiler = ParticleProfiler::Instance();
+	profiler.EndFrame(); // Samples of the other tests go to a frame of their own
+	Settings s;
+	Open<System> a(vec3(), s), b(vec3(), s);
+	const int FRAMES = 10;
+	for (int frame = 0; frame < FRAMES; frame++) {
+		for (int i = 0; i < 3; i++)
+			a.Create()->ttl = 10;
+		b.CreateBatch(5)->ttl = 10;
+		for (System * sys : { &a, &b }) {
+			sys->Integrate(0.01f);
+			sys->Finish(0.01f);
+		}
+		profiler.EndFrame();
+	}
+	FrameProfile last = profiler.Frames().back();
+	// Four of b's five particles have no ttl and die in the frame they were made
+	Check(last.systems == 2 && last.creates == 8 && last.kills == 4 && last.live == a.Count() + b.Count(),
+		"frame totals add up the samples of all systems");
+
+	const char * filename = "test_profile.json";
+	bool exported = profiler.Export(filename);
+	string trace;
+	if (FILE * in = fopen(filename, "r")) {
+		char buffer[4096];
+		for (size_t n; (n = fread(buffer, 1, sizeof(buffer), in)) > 0; )
+			trace.append(buffer, n);
+		fclose(in);
+	}
+	remove(filename);
+	auto occurrences = [&trace](const string & what) {
+		int n = 0;
+		for (size_t at = trace.find(what); at != string::npos; at = trace.find(what, at + 1))
+			n++;
+		return n;
+	};
+	char name[64];
+	snprintf(name, sizeof(name), "\"System %p\"", static_cast<void *>(&a));
+	Check(exported && trace.compare(0, 15, "{\"traceEvents\":") == 0 && trace.compare(trace.size() - 3, 3, "]}\n") == 0
+		&& occurrences(name) == FRAMES, "export writes a trace event for every frame of a system");
+	Check(!profiler.Export("no/such/dir/profile.json"), "export reports a file it can't write");
+
+	// Only the latest frames are kept
+	int next = profiler.Frame();
+	for (size_t i = 0; i < ParticleProfiler::MAX_FRAMES + 10; i++)
+		profiler.EndFrame();
+	vector<FrameProfile> frames = profiler.Frames();
+	Check(frames.size() == ParticleProfiler::MAX_FRAMES && frames.back().frame == profiler.Frame() - 1
+		&& frames.front().frame == next + 10, "profiler keeps a fixed number of the latest frames");
+#endif
+}
+
+#pragma endregion
+
+int main()
+{
+	TestScheduler();
+	TestConcurrentAllocator();
+	TestChunks();
+	TestDefragment();
+	TestTrim();
+	TestAdaptivePools();
+	TestCreateBatch();
+	TestExpiry();
+	TestSnapshot();
+	TestGrid();
+	TestProfiler();
+	printf(failures ? "%d checks failed\n" : "all checks passed\n", failures);
+	return failures ? 1 : 0;
+}
\ No newline at end of file
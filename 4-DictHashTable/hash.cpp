@@ -2,23 +2,112 @@
 #include <type_traits>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cstdint>
+#include <cwctype>
+#include <cerrno>
+#include <new>
+#include <chrono>
+#include <thread>
+#include <atomic>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define __MAPPED_READER__ // MappedReader is available
+#else
+#include <io.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define __TARGET_AVX2
+#define __TARGET_SSE42
+#else
+#define __TARGET_AVX2 __attribute__((target("avx2"))) // Only dispatched to when CPU supports it
+#define __TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#define __X86_SIMD__ // SSE2 is always there, AVX2 is checked at runtime
+#endif
 
 #define __MIN(a, b) (a < b ? a : b)
 #define __STRCMP(a, b, len) strncmp(a, b, len) // For testing different comparison functions
-#define __MAX_LOAD_FACTOR 0.6 // rehash when hashmap's LF goes over this value. At 0.6 performance is starting to drop noticeably
+#define __GROUP_LOAD_FACTOR 0.875 // Same for FrequencyHashMap, which probes a group of 16 slots at once
+
+#pragma region Portability: MSVC names on other compilers
+
+#ifdef _MSC_VER
 #define __INLINE __forceinline
+#define __PREFETCH(p) _mm_prefetch(reinterpret_cast<const char *>(p), _MM_HINT_T0)
+#else
+#define __INLINE inline __attribute__((always_inline))
+#define __PREFETCH(p) __builtin_prefetch(p)
+#define _fseeki64 fseeko
+#define _ftelli64 ftello
+
+inline int fopen_s(FILE **file, const char *filename, const char *mode)
+{
+	*file = fopen(filename, mode);
+	return *file ? 0 : errno;
+}
+#endif
+
+#pragma endregion
 
 typedef unsigned char UCHAR;
 typedef unsigned int UINT;
-typedef unsigned long DWORD;
-typedef unsigned short WORD;
+typedef uint32_t DWORD; // unsigned long is 8 bytes outside of Windows
+typedef uint16_t WORD;
 typedef UINT (*HashFunc)(const char*, size_t);
 
+// Index of the lowest set bit, mask can't be 0
+__INLINE int lowestBit(UINT mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
 #pragma region Hash functions
 
+// Unaligned loads and rotation without undefined behaviour, compilers turn them into single instructions
+__INLINE DWORD load32(const char *p)
+{
+	DWORD v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+__INLINE WORD load16(const char *p)
+{
+	WORD v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+__INLINE uint64_t load64(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+__INLINE UINT rotl32(UINT x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
 // MeiYan is the fastest function (out of ~20 benchmarked) for our set of keys
 // Meiyan - 9103.44 ms, std::_Hash - 11394.6 ms, CRC-32 - 11085.9 ms, Murmur3 - 9785.24 ms
+// Run with -b to compare the functions below on another corpus
 __INLINE UINT hashMeiyan(const char *str, size_t len)
 {
 	const UINT PRIME = 709607;
@@ -26,17 +115,17 @@ __INLINE UINT hashMeiyan(const char *str, size_t len)
 	const char *p = str;
 
 	for (; len >= 2 * sizeof(DWORD); len -= 2 * sizeof(DWORD), p += 2 * sizeof(DWORD)) {
-		hash32 = (hash32 ^ (_rotl(*(DWORD *)p, 5) ^ *(DWORD *)(p + 4))) * PRIME;
+		hash32 = (hash32 ^ (rotl32(load32(p), 5) ^ load32(p + 4))) * PRIME;
 	}
 	// Cases: 0,1,2,3,4,5,6,7
 	if (len & sizeof(DWORD)) {
-		hash32 = (hash32 ^ *(WORD*)p) * PRIME;
+		hash32 = (hash32 ^ load16(p)) * PRIME;
 		p += sizeof(WORD);
-		hash32 = (hash32 ^ *(WORD*)p) * PRIME;
+		hash32 = (hash32 ^ load16(p)) * PRIME;
 		p += sizeof(WORD);
 	}
 	if (len & sizeof(WORD)) {
-		hash32 = (hash32 ^ *(WORD*)p) * PRIME;
+		hash32 = (hash32 ^ load16(p)) * PRIME;
 		p += sizeof(WORD);
 	}
 	if (len & 1)
@@ -45,6 +134,159 @@ __INLINE UINT hashMeiyan(const char *str, size_t len)
 	return hash32 ^ (hash32 >> 16);
 }
 
+__INLINE UINT hashFnv1a(const char *str, size_t len)
+{
+	UINT hash32 = 2166136261;
+	for (size_t i = 0; i < len; i++)
+		hash32 = (hash32 ^ (UCHAR)str[i]) * 16777619;
+	return hash32;
+}
+
+// MurmurHash3 x86_32 with zero seed
+__INLINE UINT hashMurmur3(const char *str, size_t len)
+{
+	const UINT C1 = 0xcc9e2d51, C2 = 0x1b873593;
+	UINT hash32 = 0;
+	const char *p = str;
+	for (size_t n = len / 4; n; n--, p += 4) {
+		UINT k = rotl32(load32(p) * C1, 15) * C2;
+		hash32 = rotl32(hash32 ^ k, 13) * 5 + 0xe6546b64;
+	}
+	UINT k = 0;
+	switch (len & 3) {
+	case 3: k ^= (UCHAR)p[2] << 16;
+		[[fallthrough]];
+	case 2: k ^= (UCHAR)p[1] << 8;
+		[[fallthrough]];
+	case 1: k ^= (UCHAR)p[0];
+		hash32 ^= rotl32(k * C1, 15) * C2;
+	}
+	hash32 ^= (UINT)len;
+	hash32 ^= hash32 >> 16;
+	hash32 *= 0x85ebca6b;
+	hash32 ^= hash32 >> 13;
+	hash32 *= 0xc2b2ae35;
+	return hash32 ^ (hash32 >> 16);
+}
+
+// Both halves of a 64x64 bit product folded together
+__INLINE uint64_t mix64(uint64_t a, uint64_t b)
+{
+#ifdef _MSC_VER
+	uint64_t high;
+	uint64_t low = _umul128(a, b, &high);
+	return low ^ high;
+#else
+	__uint128_t product = (__uint128_t)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+#endif
+}
+
+// wyhash-style: 16 bytes per multiplication, short keys are read as two overlapping halves
+__INLINE UINT hashWy(const char *str, size_t len)
+{
+	const uint64_t P0 = 0xa0761d6478bd642full, P1 = 0xe7037ed1a0b428dbull;
+	uint64_t seed = P0 ^ len;
+	const char *p = str;
+	size_t n = len;
+	for (; n > 16; n -= 16, p += 16)
+		seed = mix64(load64(p) ^ P1, load64(p + 8) ^ seed);
+	uint64_t a = 0, b = 0;
+	if (n >= 8) {
+		a = load64(p);
+		b = load64(p + n - 8);
+	}
+	else if (n >= 4) {
+		a = load32(p);
+		b = load32(p + n - 4);
+	}
+	else if (n > 0)
+		a = ((uint64_t)(UCHAR)p[0] << 16) | ((uint64_t)(UCHAR)p[n >> 1] << 8) | (UCHAR)p[n - 1];
+	uint64_t hash64 = mix64(mix64(a ^ P1, b ^ seed) ^ P0, len ^ P1);
+	return (UINT)(hash64 ^ (hash64 >> 32));
+}
+
+// CRC-32C (Castagnoli), same values with and without SSE 4.2
+__INLINE UINT hashCrc32cSoftware(const char *str, size_t len)
+{
+	static struct Table {
+		UINT entries[256];
+		Table()
+		{
+			for (UINT i = 0; i < 256; i++) {
+				UINT crc = i;
+				for (int bit = 0; bit < 8; bit++)
+					crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+				entries[i] = crc;
+			}
+		}
+	} table;
+	UINT crc = ~0u;
+	for (size_t i = 0; i < len; i++)
+		crc = table.entries[(crc ^ (UCHAR)str[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef __X86_SIMD__
+__TARGET_SSE42 UINT hashCrc32cSse42(const char *str, size_t len)
+{
+	UINT crc = ~0u;
+	const char *p = str;
+	for (; len >= 4; len -= 4, p += 4)
+		crc = _mm_crc32_u32(crc, load32(p));
+	for (; len; len--, p++)
+		crc = _mm_crc32_u8(crc, (UCHAR)*p);
+	return ~crc;
+}
+#endif
+
+// Hardware CRC-32C when CPU has it
+inline HashFunc crc32cFunction()
+{
+#ifdef __X86_SIMD__
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	if (info[2] & (1 << 20))
+		return hashCrc32cSse42;
+#else
+	if (__builtin_cpu_supports("sse4.2"))
+		return hashCrc32cSse42;
+#endif
+#endif
+	return hashCrc32cSoftware;
+}
+
+struct NamedHash {
+	const char *name;
+	HashFunc function;
+};
+
+// Functions to choose from with -f
+const NamedHash HASH_FUNCTIONS[] = {
+	{ "meiyan", hashMeiyan },
+	{ "fnv1a", hashFnv1a },
+	{ "murmur3", hashMurmur3 },
+	{ "wy", hashWy },
+	{ "crc32c", crc32cFunction() },
+};
+
+inline HashFunc findHash(const char *name)
+{
+	for (auto &hash : HASH_FUNCTIONS)
+		if (!strcmp(hash.name, name))
+			return hash.function;
+	return nullptr;
+}
+
+inline const char *hashName(HashFunc function)
+{
+	for (auto &hash : HASH_FUNCTIONS)
+		if (hash.function == function)
+			return hash.name;
+	return nullptr;
+}
+
 #pragma endregion
 
 #pragma region String: Pascal-style string (StringView), stores a pointer to characters and own length
@@ -200,7 +442,10 @@ public:
 			T * new_data = getMemory(min_capacity);
 			// If data can be trivially moved, it will be taken care of by realloc
 			if (!std::is_trivially_move_constructible<T>::value) {
-				std::move(mData, mData + mSize, new_data);
+				for (int i = 0; i < mSize; i++) {
+					new (new_data + i) T(std::move(mData[i]));
+					mData[i].~T();
+				}
 				free(mData);
 			}
 			mData = new_data;
@@ -251,14 +496,19 @@ public:
 		assert(len < Block::SIZE);
 		if (Block::SIZE - mBlocks.back().used < len)
 			mBlocks.add(); // If current block doesn't have enough space, get a new one
-		mLast = len;
 		return mBlocks.back().add(str, len);
 	}
-	// Remove the newest string from the pool
-	void rollback()
+	// Reserve size bytes aligned to 8, for records that keep their fields in front of the characters
+	char *allocate(int size)
 	{
-		mBlocks.back().used -= mLast;
-		mLast = 0;
+		assert(size < Block::SIZE);
+		int start = (mBlocks.back().used + 7) & ~7;
+		if (Block::SIZE - start < size) {
+			mBlocks.add();
+			start = 0;
+		}
+		mBlocks.back().used = start + size;
+		return mBlocks.back().data + start;
 	}
 private:		
 	struct Block {
@@ -276,77 +526,139 @@ private:
 			data(new char[SIZE])
 		{};
 		Block(Block &&that) :
-			data(std::move(that.data)),
-			used(std::move(that.used))
-		{}
+			data(that.data),
+			used(that.used)
+		{
+			that.data = nullptr;
+		}
 		~Block() 
 		{ 
-			delete data; 
+			delete[] data; 
 		}
 	};
 private:
 	Vector<Block> mBlocks; // Allocated blocks of memory
-	int mLast{ 0 }; // Length of the last inserted string
 };
 
 #pragma endregion
 
 #pragma region HashMap: One purpose hash map for counting instances of unique strings
 
+// Control byte of every slot is either EMPTY or FULL with 7 low bits of the hash of its key. Lookups compare a group
+// of 16 control bytes at once and look at elements only when these bits match. Control array has a copy
+// of the first group at its end, so groups can start at any slot without wrapping.
+// Keys are copied by the map: short ones right into elements, so comparing them doesn't leave the table,
+// and longer ones to the map's own pool.
+// In incremental mode growing keeps the old table, and every access moves a few of its slots to the new one,
+// so there is no pause for rehashing the whole table. Until it's done, words are looked up in both
 class FrequencyHashMap {
 public:	
-	const static size_t START_SIZE = 16; // Must be a power of 2!
+	const static size_t START_SIZE = 16; // Must be a power of 2, not smaller than a group!
+	const static size_t MIGRATE_STEP = 16; // Old slots moved per access, a table is moved long before the next one is full
+	const static int INLINE_KEY = 16; // Most english words are shorter than this
 	explicit FrequencyHashMap(HashFunc function) :
-		mData(new Element[START_SIZE]),
-		mCapacity(START_SIZE),
+		mMigrated(0),
 		mUsed(0),
-		mLoadFactor(0.0),
+		mIncremental(false),
 		mHashFunction(function)
-	{}
+	{
+		if (!mTable.allocate(START_SIZE))
+			throw std::bad_alloc();
+		mLimit = limit(START_SIZE);
+	}
 	FrequencyHashMap() :
 		FrequencyHashMap(hashMeiyan)
 	{}
 	~FrequencyHashMap() { 
-		delete mData; 
+		mTable.release();
+		mOld.release();
+	}
+
+	// Grow by moving slots a few at a time instead of all at once
+	void setIncremental(bool incremental)
+	{
+		mIncremental = incremental;
+	}
+
+	// Only while the map is empty, stored hashes would be wrong otherwise
+	void setHashFunction(HashFunc function)
+	{
+		assert(mUsed == 0);
+		mHashFunction = function;
 	}
 
 	int& operator[](const String& key)
 	{
-		if (mLoadFactor > __MAX_LOAD_FACTOR) // Check this before looking for an element, or rehashing can invalidate pointer
-			reserve(mUsed * 2); // Growth factor of 2 seems reasonable
-		Hash hash = getHash(key);
-		Element * elem = findFirst(hash, key);
-		assert(elem != nullptr);
-		// Initialize element the first time it's accessed		
-		if (!elem->used) {
-			elem->hash = hash;
-			elem->key = key;
-			elem->val = 0;
-			elem->used = true;
-			mUsed++;
-			mLoadFactor = (float)mUsed / mCapacity;
+		return at(key, getHash(key));
+	}
+
+	UINT hash(const String& key) const
+	{
+		return getHash(key);
+	}
+
+	// Start loading slots where the key with this hash will be looked for, so at() doesn't wait for memory
+	void prefetch(UINT hash) const
+	{
+		size_t pos = (hash >> 7) & (mTable.capacity - 1);
+		__PREFETCH(mTable.control + pos);
+		__PREFETCH(mTable.data + pos);
+	}
+
+	// Same as operator[], but with a hash that was already calculated for the key
+	int& at(const String& key, UINT hash)
+	{
+		if (mUsed >= mLimit) // Check this before looking for an element, or rehashing can invalidate pointer
+			grow();
+		if (mOld.control)
+			migrate(MIGRATE_STEP);
+		size_t index;
+		if (!mTable.find(hash, key, index)) {
+			size_t old_index;
+			if (mOld.control && mOld.find(hash, key, old_index)) {
+				// Word isn't moved yet, move it now
+				mTable.put(index, mOld.data[old_index]);
+				mOld.setControl(old_index, DELETED);
+			}
+			else {
+				// Initialize element the first time it's accessed		
+				Element elem;
+				elem.hash = hash;
+				elem.val = 0;
+				elem.len = key.len;
+				if (key.len <= INLINE_KEY)
+					memcpy(elem.chars, key.str, key.len);
+				else
+					elem.str = mStrings.add(key.str, key.len).str;
+				mTable.put(index, elem);
+				mUsed++;
+			}
 		}
-		return elem->val;
+		return mTable.data[index].val;
 	}
 
-	void reserve(size_t count)
+	// False if a bigger table couldn't be allocated, the map stays as it was then
+	bool reserve(size_t count)
 	{
+		finishMigration();
 		// Make sure table's size is always a power of 2 for faster modulos
-		size_t new_size = nextPowerOf2((size_t)(count / __MAX_LOAD_FACTOR));
-		if (new_size > size()) {
-			Element * old_data = mData;
-			size_t old_size = mCapacity;
-			mData = new Element[new_size];
-			mCapacity = new_size;
+		size_t new_size = nextPowerOf2((size_t)(count / __GROUP_LOAD_FACTOR));
+		if (new_size > mTable.capacity) {
+			Table bigger;
+			if (!bigger.allocate(new_size))
+				return false;
+			Table old = mTable;
+			mTable = bigger;
+			mLimit = limit(new_size);
 			// Move old data to the new place
-			for (size_t i = 0; i < old_size; i++) {
-				if (old_data[i].used) {
-					reinsert(old_data[i]); // Keep in mind that collisions can occur
+			for (size_t i = 0; i < old.capacity; i++) {
+				if (isFull(old.control[i])) {
+					reinsert(old.data[i]); // Keep in mind that collisions can occur
 				}
 			}
-			mLoadFactor = (float)mUsed / mCapacity;
-			delete old_data;
+			old.release();
 		}
+		return true;
 	}
 
 	size_t size() const
@@ -356,65 +668,232 @@ public:
 
 	float loadFactor() const
 	{
-		return mLoadFactor;
+		return (float)mUsed / mTable.capacity;
 	}
 
 	void toList(WordList &list) const {
 		list.reserve(size());
 		list.clear();
-		for (int i = 0; i < mCapacity; i++)
-			if (mData[i].used) {
-				list.add(WordCount(mData[i].key, mData[i].val));
-			}
+		forEach([&list](const String &key, UINT /*hash*/, int val) { list.add(WordCount(key, val)); });
+	}
+
+	// Number of groups looked at to find the key, for comparing hash functions
+	int probeLength(const String &key) const
+	{
+		size_t index;
+		int groups = 0;
+		mTable.find(getHash(key), key, index, &groups);
+		return groups;
+	}
+
+	// Call f(key, hash, count) for every stored word. Keys point into the map and stay valid until it grows
+	template <typename Function>
+	void forEach(Function f) const {
+		for (const Table *table : { &mTable, &mOld })
+			for (size_t i = 0; i < table->capacity; i++)
+				if (isFull(table->control[i]))
+					f(table->data[i].key(), table->data[i].hash, table->data[i].val);
 	}
 
 private:
 	typedef UINT Hash;
+	const static UCHAR EMPTY = 0x00; // Zero, so fresh tables come from calloc without touching their memory
+	const static UCHAR DELETED = 0x01; // Moved to the new table. Unlike EMPTY, doesn't stop probing
+	const static UCHAR FULL = 0x80;
+	const static UCHAR HASH_BITS = 0x7F; // Hash bits kept in control bytes, the rest of them picks a slot
 	struct Element {
 		Hash hash;
 		int val;
-		String key;
-		bool used;
-		Element() :
-			used(false)
-		{};
+		int len;
+		union {
+			char chars[INLINE_KEY]; // Short keys are stored here
+			char *str; // Long ones in mStrings
+		};
+		char *data()
+		{
+			return len <= INLINE_KEY ? chars : str;
+		}
+		String key()
+		{
+			return String(data(), len);
+		}
+	};
+	// Control bytes of 16 consecutive slots as bitmasks
+	struct Group {
+		const static int SIZE = 16;
+#ifdef __X86_SIMD__
+		__m128i control;
+		explicit Group(const UCHAR *p) :
+			control(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)))
+		{}
+		UINT match(UCHAR c) const
+		{
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)c)));
+		}
+#else
+		const UCHAR *control;
+		explicit Group(const UCHAR *p) :
+			control(p)
+		{}
+		UINT match(UCHAR c) const
+		{
+			UINT mask = 0;
+			for (int i = 0; i < SIZE; i++)
+				mask |= (UINT)(control[i] == c) << i;
+			return mask;
+		}
+#endif
+	};
+	struct Table {
+		UCHAR *control{ nullptr };
+		Element *data{ nullptr };
+		size_t capacity{ 0 };
+
+		// Large blocks are mapped zeroed by the system, so growing doesn't stall on initializing them.
+		// False if there isn't enough memory, the table stays empty then
+		bool allocate(size_t size)
+		{
+			control = reinterpret_cast<UCHAR *>(calloc(size + Group::SIZE, 1));
+			data = reinterpret_cast<Element *>(calloc(size, sizeof(Element)));
+			if (!control || !data) {
+				fprintf(stderr, "Not enough memory for a hash table of %zu slots\n", size);
+				release();
+				return false;
+			}
+			capacity = size;
+			return true;
+		}
+
+		void release()
+		{
+			free(control);
+			free(data);
+			*this = Table();
+		}
+
+		void setControl(size_t index, UCHAR c)
+		{
+			control[index] = c;
+			if (index < Group::SIZE)
+				control[capacity + index] = c; // Keep the copy of the first group in sync
+		}
+
+		void put(size_t index, const Element &elem)
+		{
+			setControl(index, FULL | (elem.hash & HASH_BITS));
+			data[index] = elem;
+		}
+
+		// Returns true and index of the key if it's found, otherwise false and index of a free slot for it
+		bool find(const Hash& hash, const String &key, size_t &index, int *groups = nullptr) const
+		{
+			size_t mask = capacity - 1;
+			size_t pos = (hash >> 7) & mask;
+			// Groups are visited in triangular order, which covers the whole table when its size is a power of 2
+			for (size_t step = Group::SIZE; ; step += Group::SIZE) {
+				if (groups)
+					(*groups)++;
+				Group group(control + pos);
+				for (UINT match = group.match(FULL | (hash & HASH_BITS)); match; match &= match - 1) {
+					size_t i = (pos + lowestBit(match)) & mask;
+					if (data[i].hash == hash && data[i].len == key.len && !memcmp(data[i].data(), key.str, key.len)) {
+						index = i;
+						return true;
+					}
+				}
+				UINT empty = group.match(EMPTY);
+				if (empty) {
+					index = (pos + lowestBit(empty)) & mask;
+					return false;
+				}
+				pos = (pos + step) & mask;
+			}
+		}
+
+		// Index of a free slot for a key that isn't in the table
+		size_t freeSlot(const Hash& hash) const
+		{
+			size_t mask = capacity - 1;
+			size_t pos = (hash >> 7) & mask;
+			for (size_t step = Group::SIZE; ; step += Group::SIZE) {
+				UINT empty = Group(control + pos).match(EMPTY);
+				if (empty)
+					return (pos + lowestBit(empty)) & mask;
+				pos = (pos + step) & mask;
+			}
+		}
 	};
 private:
-	Element *mData;
-	size_t mCapacity;
-	int mUsed;
-	float mLoadFactor; // Optimization: store load factor and recalculate on insertions
+	Table mTable;
+	Table mOld; // Table being moved to mTable in incremental mode
+	size_t mMigrated; // Slots of mOld moved so far
+	size_t mLimit; // Grow when this many words are stored
+	size_t mUsed;
+	bool mIncremental;
 	HashFunc mHashFunction;
+	StringPool mStrings; // Keys that are too long to be stored inline
+
+	static bool isFull(UCHAR control)
+	{
+		return (control & FULL) != 0;
+	}
+
+	static size_t limit(size_t capacity)
+	{
+		return (size_t)(capacity * __GROUP_LOAD_FACTOR);
+	}
 
-	Element *findFirst(const Hash& hash, const String &key) const
-	{		
-		int index = hash & (mCapacity-1); // hash % mCapacity
-		int i = index;
-		// Look until find a matching or unused element and mind the end of an array 
-		while (i < mCapacity && mData[i].used && (mData[i].hash != hash || mData[i].key != key))
-			i++;		
-		if (i == mCapacity) {
-			// Reset to start and keep looking until we hit the full cycle. Faster than doing one cycle with i % mCapacity
-			i = 0;
-			while (i < index && mData[i].used && (mData[i].hash != hash || mData[i].key != key))
-				i++;
-			assert(i != index);
+	void grow()
+	{
+		if (!mIncremental) {
+			if (!reserve(mUsed * 2)) // Growth factor of 2 seems reasonable
+				keepFilling();
+			return;
+		}
+		finishMigration(); // Shouldn't happen, old table is moved long before
+		Table bigger;
+		if (!bigger.allocate(mTable.capacity * 2)) {
+			keepFilling();
+			return;
 		}
-		return mData + i;
+		mOld = mTable;
+		mTable = bigger;
+		mLimit = limit(mTable.capacity);
+		mMigrated = 0;
+	}
+
+	// Table couldn't grow: fill it up while lookups still end at an empty slot, then fail like new does
+	void keepFilling()
+	{
+		if (mUsed + 1 >= mTable.capacity)
+			throw std::bad_alloc();
+		mLimit = mTable.capacity - 1;
+	}
+
+	// Move next count slots of the old table
+	void migrate(size_t count)
+	{
+		size_t end = __MIN(mMigrated + count, mOld.capacity);
+		for (; mMigrated < end; mMigrated++)
+			if (isFull(mOld.control[mMigrated])) {
+				reinsert(mOld.data[mMigrated]);
+				mOld.setControl(mMigrated, DELETED);
+			}
+		if (mMigrated == mOld.capacity)
+			mOld.release();
+	}
+
+	void finishMigration()
+	{
+		if (mOld.control)
+			migrate(mOld.capacity);
 	}
 
 	void reinsert(Element &elem)
 	{
-		assert(mUsed < mCapacity);
-		int index = elem.hash & (mCapacity - 1); // hash % mCapacity
+		assert(mUsed < mTable.capacity);
 		// Avoiding collision on reinsert
-		while (index < mCapacity && mData[index].used)
-			index++;
-		if (index == mCapacity)
-			index = 0;
-		while (mData[index].used)
-			index++;
-		mData[index] = elem;
+		mTable.put(mTable.freeSlot(elem.hash), elem);
 	}
 
 	Hash getHash(const String &key) const
@@ -425,18 +904,10 @@ private:
 	size_t nextPowerOf2(size_t val)
 	{
 		// This doesn't affect overall performance, hence no bithacks
-		int power = 0;
-		bool round = true;
-		size_t res = val;
-		while (res > 1) {
-			if (res && 1)
-				round = false;
-			res >>= 1;
-			power++;
-		}
-		if (!round)
-			power++;
-		return 1ULL << power;
+		size_t res = START_SIZE;
+		while (res < val)
+			res <<= 1;
+		return res;
 	}
 
 };
@@ -445,6 +916,215 @@ typedef FrequencyHashMap HashMap;
 
 #pragma endregion
 
+#pragma region ConcurrentHashMap: CAS-based FrequencyHashMap shared by all parser threads
+
+// Open addressing where a slot is claimed by publishing its entry with a single CAS, so a reader never finds
+// a half-written slot and no thread waits for another. Counters are incremented atomically. When a table gets
+// full a bigger one is linked to it, and every thread that runs into the old table helps moving it chunk by chunk.
+// Old tables are kept until destruction, since other threads may still be reading them
+class ConcurrentFrequencyHashMap {
+public:
+	const static int START_SIZE = 1 << 12; // Must be a power of 2!
+	explicit ConcurrentFrequencyHashMap(HashFunc function) :
+		mFirst(new Table(START_SIZE)),
+		mTable(mFirst),
+		mHashFunction(function)
+	{}
+	ConcurrentFrequencyHashMap() :
+		ConcurrentFrequencyHashMap(hashMeiyan)
+	{}
+	~ConcurrentFrequencyHashMap()
+	{
+		while (mFirst) {
+			Table *next = mFirst->next.load();
+			delete mFirst;
+			mFirst = next;
+		}
+	}
+
+	// Count one more occurence of the key.
+	// Entry of a new key is made in the calling thread's pool, so the pool needs no locking
+	void increment(const String &key, StringPool &strings)
+	{
+		UINT hash = mHashFunction(key.str, key.len);
+		Entry *entry = nullptr; // Made when the key turns out to be new
+		Table *table = mTable.load(std::memory_order_acquire);
+		while (!tryAdd(table, key, hash, 1, entry, &strings))
+			table = grow(table);
+	}
+
+	// Not thread-safe, call when all threads are done
+	size_t size() const
+	{
+		return last()->used.load();
+	}
+
+	// Not thread-safe, call when all threads are done
+	template <typename Function>
+	void forEach(Function f) const {
+		Table *table = last();
+		for (int i = 0; i < table->capacity; i++) {
+			Slot &slot = table->slots[i];
+			Entry *entry = slot.entry.load(std::memory_order_relaxed);
+			if (entry && entry != &mMoved)
+				f(entry->key(), entry->hash, slot.val.load(std::memory_order_relaxed));
+		}
+	}
+
+	void toList(WordList &list) const {
+		list.reserve(size());
+		list.clear();
+		forEach([&list](const String &key, UINT /*hash*/, int64_t val) { list.add(WordCount(key, (int)__MIN(val, (int64_t)INT_MAX))); });
+	}
+private:
+	const static int64_t FROZEN = (int64_t)1 << 62; // Set in a counter when its slot is being moved, real counts stay below it
+	const static int CHUNK_SIZE = 1024; // Slots moved at a time by one thread
+	constexpr static double MAX_LOAD_FACTOR = 0.6; // Grow when the table is filled this much, linear probing slows down past it
+	// Hash and length of a key, its characters follow. Never changes once published,
+	// a moved slot publishes the same entry in the next table
+	struct Entry {
+		UINT hash;
+		int len;
+		String key()
+		{
+			return String(reinterpret_cast<char *>(this + 1), len);
+		}
+	};
+	struct Slot {
+		std::atomic<Entry *> entry{ nullptr }; // nullptr while the slot is empty
+		std::atomic<int64_t> val{ 0 };
+	};
+	struct Table {
+		Slot *slots;
+		int capacity;
+		int limit; // Grow when this many slots are used
+		int chunks;
+		std::atomic<int> used{ 0 };
+		std::atomic<Table *> next{ nullptr }; // Bigger table slots are moved to
+		std::atomic<int> claimed{ 0 }; // Chunks taken by moving threads
+		std::atomic<int> moved{ 0 }; // Chunks done
+		explicit Table(int size) :
+			slots(new Slot[size]),
+			capacity(size),
+			limit((int)(size * MAX_LOAD_FACTOR)),
+			chunks(size > CHUNK_SIZE ? size / CHUNK_SIZE : 1)
+		{}
+		~Table()
+		{
+			delete[] slots;
+		}
+	};
+private:
+	Table *mFirst; // Owns the chain of tables
+	std::atomic<Table *> mTable; // Table new words go to
+	HashFunc mHashFunction;
+	Entry mMoved{ 0, 0 }; // Put in empty slots of a table being moved, so nothing can be added to them
+
+	Table *last() const
+	{
+		Table *table = mFirst;
+		while (table->next.load())
+			table = table->next.load();
+		return table;
+	}
+
+	// Returns false if the table is full or being moved, so the key belongs to the next table.
+	// Entry is made from the key in strings the first time it's needed, and the same one is tried in the next tables
+	bool tryAdd(Table *table, const String &key, UINT hash, int64_t count, Entry *&entry, StringPool *strings)
+	{
+		int mask = table->capacity - 1;
+		int index = hash & mask;
+		for (int probe = 0; probe < table->capacity; probe++) {
+			Slot &slot = table->slots[index];
+			Entry *current = slot.entry.load(std::memory_order_acquire);
+			if (!current) {
+				if (table->used.load(std::memory_order_relaxed) >= table->limit)
+					return false;
+				if (!entry) {
+					// Keys from the parser's buffer have to be moved to permanent memory
+					entry = reinterpret_cast<Entry *>(strings->allocate(sizeof(Entry) + key.len));
+					entry->hash = hash;
+					entry->len = key.len;
+					memcpy(entry + 1, key.str, key.len);
+				}
+				if (slot.entry.compare_exchange_strong(current, entry, std::memory_order_acq_rel)) {
+					table->used.fetch_add(1, std::memory_order_relaxed);
+					current = entry;
+				}
+				// Otherwise current holds what another thread has put there
+			}
+			if (current == &mMoved)
+				return false;
+			if (current == entry || current->hash == hash && !(current->key() != key)) {
+				int64_t val = slot.val.load(std::memory_order_relaxed);
+				do {
+					if (val & FROZEN)
+						return false;
+				} while (!slot.val.compare_exchange_weak(val, val + count, std::memory_order_relaxed));
+				return true;
+			}
+			index = (index + 1) & mask;
+		}
+		return false;
+	}
+
+	// Make sure the next table exists, help moving slots into it and return it
+	Table *grow(Table *table)
+	{
+		Table *next = table->next.load(std::memory_order_acquire);
+		if (!next) {
+			Table *bigger = new Table(table->capacity * 2);
+			if (table->next.compare_exchange_strong(next, bigger, std::memory_order_acq_rel))
+				next = bigger;
+			else
+				delete bigger; // Lost the race, next now points to the winner's table
+		}
+		while (table->claimed.load(std::memory_order_relaxed) < table->chunks) {
+			int chunk = table->claimed.fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= table->chunks)
+				break;
+			moveChunk(table, next, chunk);
+			if (table->moved.fetch_add(1, std::memory_order_acq_rel) + 1 == table->chunks)
+				advance();
+		}
+		return next;
+	}
+
+	void moveChunk(Table *from, Table *to, int chunk)
+	{
+		int end = __MIN((chunk + 1) * CHUNK_SIZE, from->capacity);
+		for (int i = chunk * CHUNK_SIZE; i < end; i++) {
+			Slot &slot = from->slots[i];
+			Entry *entry = slot.entry.load(std::memory_order_acquire);
+			// Close empty slots, so nothing can be added to them anymore
+			if (!entry && slot.entry.compare_exchange_strong(entry, &mMoved, std::memory_order_acq_rel))
+				continue;
+			// Freeze the counter, increments that come after it go to the new table.
+			// Count may still be 0 if the entry was just published, its first increment follows it there
+			int64_t val = slot.val.fetch_or(FROZEN, std::memory_order_acq_rel);
+			for (Table *table = to; !tryAdd(table, entry->key(), entry->hash, val, entry, nullptr); )
+				table = grow(table);
+		}
+	}
+
+	// Point mTable past tables that are completely moved
+	void advance()
+	{
+		Table *table = mTable.load(std::memory_order_acquire);
+		for (;;) {
+			Table *next = table->next.load(std::memory_order_acquire);
+			if (!next || table->moved.load(std::memory_order_acquire) != table->chunks)
+				break;
+			if (mTable.compare_exchange_strong(table, next, std::memory_order_acq_rel))
+				table = next;
+		}
+	}
+};
+
+typedef ConcurrentFrequencyHashMap ConcurrentHashMap;
+
+#pragma endregion
+
 #pragma region CharacterTable: Lookup table for determining valid characters and lowercase conversion
 
 struct CharacterTable {
@@ -474,12 +1154,22 @@ public:
 	void tailRead(size_t tail)
 	{
 		memcpy(mBuffer, mBuffer + mDataSize - tail, tail);
-		mDataSize = tail + fread(mBuffer + tail, sizeof(char), BUFFER_SIZE-tail, mInput);
+		size_t count = (size_t)__MIN((long long)(BUFFER_SIZE - tail), mRemaining);
+		size_t read = fread(mBuffer + tail, sizeof(char), count, mInput);
+		mRemaining -= read;
+		mDataSize = tail + read;
 	}
 
+	// File that couldn't be opened reads as empty
 	bool done() const
 	{
-		return feof(mInput) > 0;
+		return !mInput || mRemaining == 0 || feof(mInput) > 0;
+	}
+
+	// File couldn't be opened, the error is already printed
+	bool failed() const
+	{
+		return !mInput;
 	}
 
 	UCHAR *buffer() const
@@ -495,97 +1185,1398 @@ public:
 	Reader(const char *filename) :
 		mBuffer(new UCHAR[BUFFER_SIZE + 1])
 	{
-		fopen_s(&mInput, filename, "r");
+		// Binary mode, so offsets of ranges match the file size
+		if (fopen_s(&mInput, filename, "rb")) {
+			perror(filename);
+			mInput = nullptr;
+		}
 	};
 
+	// Read only length bytes starting at offset
+	Reader(const char *filename, long long offset, long long length) :
+		Reader(filename)
+	{
+		if (mInput)
+			_fseeki64(mInput, offset, SEEK_SET);
+		mRemaining = length;
+	}
+
 	~Reader()
 	{
-		delete mBuffer;
-		fclose(mInput);
+		delete[] mBuffer;
+		if (mInput)
+			fclose(mInput);
 	}
 private:
 	const static size_t BUFFER_SIZE = 1024 * 1024;
-	FILE *mInput;
+	FILE *mInput{ nullptr };
 	UCHAR *mBuffer;
 	size_t mDataSize{ 0 };
+	long long mRemaining{ LLONG_MAX }; // Bytes left in the range
 };
 
 #pragma endregion
 
-#pragma region Parser: Read file, parse words from it, store them in memory and count using supplied hashmap
+#ifdef __MAPPED_READER__
 
-class Parser {
+#pragma region MappedReader: Whole file (or its range) mapped to memory, same interface as Reader
+
+class MappedReader {
 public:
-	const static int MAX_WORD = 1024;
-public:	
-	void parse(Reader& reader, CharacterTable &lookup, StringPool &strings, HashMap& map)
+	// Everything is available after the first call, so there is never a tail to move
+	void tailRead(size_t tail)
 	{
-		// Unparsed word-characters at the end of the buffer, potentially part of a word
-		int tail = 0;
-		while (!reader.done()) {
-			reader.tailRead(tail); // Move unparsed tail to the start and read more data
-			UCHAR *p = reader.buffer();
-			UCHAR *end = p + reader.dataSize();
-			while (p < end) {
-				// Skip non-word characters
-				while (p < end && !lookup.valid[*p]) {
-					p++;
-				}
-				if (p == end)
-					continue;
-				UCHAR *word = p;
-				UCHAR *word_end = __MIN(word + MAX_WORD, end); // Make sure that we won't go beyond buffer
-				while (p < word_end && lookup.valid[*p]) { 
-					*p = lookup.lower[*p];
-					//*p |= 0x20; // Not worth it
-					p++;
-				}
-				int len = p - word;
-				// Current word may be split in two by the end of the buffer, so remember to parse it on next read
-				if (p == end && len < MAX_WORD && !reader.done()) {
-					tail = end - word;
-				} else {
-					// Make a new string in the pool, so map would store a pointer to a permanent memory and not temporary buffer
-					String s = strings.add(reinterpret_cast<char *>(word), len);
-					if (map[s]++ != 0) {
-						// This word was already in map, so we don't need to store it in pool twice
-						strings.rollback();
-					}
-					tail = 0; // Whatever unparsed character there were, we've taken care of them
-					if (len == MAX_WORD) // If we've hit length limit, cur word and skip following character
-						while (p < end && lookup.valid[*p])
-							p++;
-				}					
-			}
-		}
+		assert(tail == 0);
+		mDone = true;
 	}
+
+	bool done() const
+	{
+		return mDone;
+	}
+
+	// File couldn't be opened or mapped, the error is already printed. Empty range isn't a failure
+	bool failed() const
+	{
+		return mFailed;
+	}
+
+	UCHAR *buffer() const
+	{
+		return mData;
+	}
+
+	size_t dataSize() const
+	{
+		return mDataSize;
+	}
+
+	MappedReader(const char *filename) :
+		MappedReader(filename, 0, LLONG_MAX)
+	{}
+
+	MappedReader(const char *filename, long long offset, long long length)
+	{
+		struct stat info;
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0 || fstat(fd, &info) != 0) {
+			perror(filename);
+			if (fd >= 0)
+				close(fd);
+			mFailed = mDone = true;
+			return;
+		}
+		length = __MIN(length, info.st_size - offset);
+		if (length > 0) {
+			// Mapping has to start on a page boundary
+			long long start = offset & ~(long long)(sysconf(_SC_PAGESIZE) - 1);
+			mMappedSize = (size_t)(offset + length - start);
+			void *mapping = mmap(nullptr, mMappedSize, PROT_READ, MAP_PRIVATE, fd, start);
+			if (mapping != MAP_FAILED) {
+				madvise(mapping, mMappedSize, MADV_SEQUENTIAL); // Kernel reads ahead more aggressively
+				mMapping = mapping;
+				mData = reinterpret_cast<UCHAR *>(mapping) + (offset - start);
+				mDataSize = (size_t)length;
+			}
+			else {
+				perror(filename);
+				mFailed = mDone = true;
+			}
+		}
+		close(fd);
+	}
+
+	~MappedReader()
+	{
+		if (mMapping)
+			munmap(mMapping, mMappedSize);
+	}
+private:
+	void *mMapping{ nullptr };
+	size_t mMappedSize{ 0 };
+	UCHAR *mData{ nullptr }; // Read-only
+	size_t mDataSize{ 0 };
+	bool mDone{ false };
+	bool mFailed{ false };
+};
+
+#pragma endregion
+
+#endif
+
+#pragma region Tokenizer: Word boundaries and lowercasing by blocks of 16/32 characters
+
+// Only valid for latin letters with standard lowercasing, see supports(). Every block is turned into a bitmask
+// with a bit per character that is set for letters, so a boundary is the first set or unset bit
+class Tokenizer {
+public:
+	enum Level { SCALAR, SSE2, AVX2 };
+
+	Tokenizer() :
+		mLevel(detect())
+	{}
+
+	// True if the table is exactly what the kernels hardcode
+	static bool supports(const CharacterTable &table)
+	{
+		for (int c = 0; c < CharacterTable::MAX_CHAR; c++) {
+			if (table.valid[c] != isLetter(c))
+				return false;
+			if (table.valid[c] && table.lower[c] != (c | 0x20))
+				return false;
+		}
+		return true;
+	}
+
+	// Number of non-letters at the start of p, up to size
+	size_t skip(const UCHAR *p, size_t size) const
+	{
+		size_t i = 0;
+#ifdef __X86_SIMD__
+		if (mLevel == AVX2)
+			i = skipAvx2(p, size);
+		else if (mLevel == SSE2)
+			i = skipSse2(p, size);
+		if (i < size && isLetter(p[i]))
+			return i;
+#endif
+		while (i < size && !isLetter(p[i]))
+			i++;
+		return i;
+	}
+
+	// Number of letters at the start of p, up to size, which are copied to out in lowercase
+	size_t scan(const UCHAR *p, size_t size, char *out) const
+	{
+		size_t i = 0;
+#ifdef __X86_SIMD__
+		if (mLevel == AVX2)
+			i = scanAvx2(p, size, out);
+		else if (mLevel == SSE2)
+			i = scanSse2(p, size, out);
+		if (i < size && !isLetter(p[i]))
+			return i;
+#endif
+		for (; i < size && isLetter(p[i]); i++)
+			out[i] = p[i] | 0x20;
+		return i;
+	}
+private:
+	Level mLevel;
+
+	static bool isLetter(int c)
+	{
+		return (unsigned)((c | 0x20) - 'a') < 26;
+	}
+
+	static Level detect()
+	{
+#ifdef __X86_SIMD__
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] >= 7) {
+			__cpuid(info, 1);
+			bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6; // OS saves YMM registers
+			__cpuidex(info, 7, 0);
+			if (avx && (info[1] & (1 << 5)))
+				return AVX2;
+		}
+#else
+		if (__builtin_cpu_supports("avx2"))
+			return AVX2;
+#endif
+		return SSE2; // Always there on x64
+#else
+		return SCALAR;
+#endif
+	}
+
+#ifdef __X86_SIMD__
+	// Letters become 'a'..'z' after setting 0x20 bit. Shifted by 128 - 'a' they're the lowest signed values,
+	// so one signed comparison classifies them
+	static __m128i lettersSse2(__m128i v)
+	{
+		__m128i shifted = _mm_add_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8((char)(128 - 'a')));
+		return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + 26)));
+	}
+
+	static size_t skipSse2(const UCHAR *p, size_t size)
+	{
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16) {
+			UINT mask = _mm_movemask_epi8(lettersSse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i))));
+			if (mask)
+				return i + lowestBit(mask);
+		}
+		return i;
+	}
+
+	static size_t scanSse2(const UCHAR *p, size_t size, char *out)
+	{
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+			__m128i letters = lettersSse2(v);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_or_si128(v, _mm_and_si128(letters, _mm_set1_epi8(0x20))));
+			UINT mask = ~_mm_movemask_epi8(letters) & 0xFFFF;
+			if (mask)
+				return i + lowestBit(mask);
+		}
+		return i;
+	}
+
+	__TARGET_AVX2 static __m256i lettersAvx2(__m256i v)
+	{
+		__m256i shifted = _mm256_add_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8((char)(128 - 'a')));
+		return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + 26)), shifted);
+	}
+
+	__TARGET_AVX2 static size_t skipAvx2(const UCHAR *p, size_t size)
+	{
+		size_t i = 0;
+		for (; i + 32 <= size; i += 32) {
+			UINT mask = (UINT)_mm256_movemask_epi8(lettersAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i))));
+			if (mask)
+				return i + lowestBit(mask);
+		}
+		return i;
+	}
+
+	__TARGET_AVX2 static size_t scanAvx2(const UCHAR *p, size_t size, char *out)
+	{
+		size_t i = 0;
+		for (; i + 32 <= size; i += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+			__m256i letters = lettersAvx2(v);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_or_si256(v, _mm256_and_si256(letters, _mm256_set1_epi8(0x20))));
+			UINT mask = ~(UINT)_mm256_movemask_epi8(letters);
+			if (mask)
+				return i + lowestBit(mask);
+		}
+		return i;
+	}
+#endif
 };
 
 #pragma endregion
 
+#pragma region Parser: Read file, parse words from it, store them in memory and count using supplied hashmap
+
+class Parser {
+public:
+	const static int MAX_WORD = 1024;
+public:	
+	const static int BATCH_SIZE = 16; // Words hashed and prefetched before any of them is counted
+public:	
+	// Input is only read, words are lowercased into a private buffer
+	template <typename Input, typename Map>
+	void parse(Input& reader, CharacterTable &lookup, StringPool &strings, Map& map)
+	{
+		// Table of latin letters is handled by the vectorized tokenizer
+		bool fast = Tokenizer::supports(lookup);
+		// Unparsed word-characters at the end of the buffer, potentially part of a word
+		int tail = 0;
+		while (!reader.done()) {
+			reader.tailRead(tail); // Move unparsed tail to the start and read more data
+			UCHAR *p = reader.buffer();
+			UCHAR *end = p + reader.dataSize();
+			while (p < end) {
+				// Skip non-word characters
+				if (fast)
+					p += mTokenizer.skip(p, end - p);
+				else
+					while (p < end && !lookup.valid[*p]) {
+						p++;
+					}
+				if (p == end)
+					continue;
+				UCHAR *word = p;
+				UCHAR *word_end = __MIN(word + MAX_WORD, end); // Make sure that we won't go beyond buffer
+				if (fast)
+					p += mTokenizer.scan(p, word_end - p, mWord);
+				else {
+					char *lower = mWord;
+					while (p < word_end && lookup.valid[*p]) { 
+						*lower++ = lookup.lower[*p];
+						//*p |= 0x20; // Not worth it
+						p++;
+					}
+				}
+				int len = p - word;
+				// Current word may be split in two by the end of the buffer, so remember to parse it on next read
+				if (p == end && len < MAX_WORD && !reader.done()) {
+					tail = end - word;
+				} else {
+					countWord(mWord, len, strings, map);
+					tail = 0; // Whatever unparsed character there were, we've taken care of them
+					if (len == MAX_WORD) // If we've hit length limit, cur word and skip following character
+						while (p < end && lookup.valid[*p])
+							p++;
+				}					
+			}
+		}
+		// Concurrent map isn't batched, see countWord
+		if constexpr (std::is_same<Map, HashMap>::value)
+			flush(map);
+	}
+private:
+	// Words of the current batch, followed by the space for the next one
+	char mBatch[2 * MAX_WORD];
+	char *mWord{ mBatch }; // Lowercased copy of the current word
+	String mBatchWords[BATCH_SIZE];
+	int mBatchCount{ 0 };
+	Tokenizer mTokenizer;
+
+	// Words are collected in batches, so slots of a whole batch are loaded from memory at the same time.
+	// Pool isn't needed, the map copies new words itself
+	void countWord(char *word, int len, StringPool &/*strings*/, HashMap &map)
+	{
+		mBatchWords[mBatchCount++] = String(word, len);
+		mWord += len;
+		if (mBatchCount == BATCH_SIZE || mWord - mBatch > MAX_WORD)
+			flush(map);
+	}
+
+	// Every word is counted right away: the concurrent map hashes and probes inside increment, while the table
+	// can be replaced by a resize, so there is no separate prefetch step to batch. It copies new words to the pool itself
+	void countWord(char *word, int len, StringPool &strings, ConcurrentHashMap &map)
+	{
+		map.increment(String(word, len), strings);
+	}
+
+	void flush(HashMap &map)
+	{
+		UINT hashes[BATCH_SIZE];
+		for (int i = 0; i < mBatchCount; i++) {
+			hashes[i] = map.hash(mBatchWords[i]);
+			map.prefetch(hashes[i]);
+		}
+		// Map copies new words itself, short ones right into its table
+		for (int i = 0; i < mBatchCount; i++)
+			map.at(mBatchWords[i], hashes[i])++;
+		mBatchCount = 0;
+		mWord = mBatch;
+	}
+};
+
+#pragma endregion
+
+#pragma region Options: Command line arguments
+
+struct Options {
+	const char *input{ nullptr };
+	const char *output{ nullptr };
+	int threads{ 1 }; // Number of parser threads
+	bool concurrent{ false }; // All threads count into one shared map instead of merging their own
+	bool mapped{ false }; // Map the input to memory instead of reading it, where it's supported
+	bool incremental{ false }; // Grow maps gradually, without pauses for rehashing
+	HashFunc hash{ hashMeiyan };
+	bool benchmark{ false }; // Compare hash functions on the input instead of counting it
+	int top{ 0 }; // Write only this many most frequent words, all of them if 0
+	const char *dictionary{ nullptr }; // Add counts to this file, output is optional then
+	char **query{ nullptr }; // Words to look up in the dictionary instead of counting anything
+	int queries{ 0 };
+
+	// hash <input> <output> [-t threads] [-c] [-m] [-i] [-f hash] [-k top] [-d dictionary]
+	// hash <input> -b
+	// hash -d dictionary -q word...
+	bool parse(int argc, char* argv[])
+	{
+		for (int i = 1; i < argc; i++) {
+			if (!strcmp(argv[i], "-t") && i + 1 < argc)
+				threads = atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-c"))
+				concurrent = true;
+			else if (!strcmp(argv[i], "-m"))
+				mapped = true;
+			else if (!strcmp(argv[i], "-i"))
+				incremental = true;
+			else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+				hash = findHash(argv[++i]);
+				if (!hash)
+					return false;
+			}
+			else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+				top = atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+				dictionary = argv[++i];
+			else if (!strcmp(argv[i], "-q")) {
+				// All remaining arguments are words
+				query = argv + i + 1;
+				queries = argc - i - 1;
+				break;
+			}
+			else if (!strcmp(argv[i], "-b"))
+				benchmark = true;
+			else if (!input)
+				input = argv[i];
+			else if (!output)
+				output = argv[i];
+			else
+				return false;
+		}
+		if (threads < 1)
+			threads = 1;
+		if (query)
+			return dictionary && queries > 0;
+		return input && (output || benchmark || dictionary);
+	}
+};
+
+#pragma endregion
+
+#pragma region Threads: Running a function in several threads
+
+// Call f(i) in count threads and wait for all of them
+template <typename Function>
+void runThreads(int count, Function f)
+{
+	std::thread *threads = new std::thread[count];
+	for (int i = 0; i < count; i++)
+		threads[i] = std::thread(f, i);
+	for (int i = 0; i < count; i++)
+		threads[i].join();
+	delete[] threads;
+}
+
+#pragma endregion
+
+#pragma region WordCounter: Count words of a file in one or several threads
+
+// With several threads the file is split in ranges on word boundaries and every thread counts its range
+// into its own map and pool. Words are then partitioned by hash, so every thread merges its own shard.
+// In concurrent mode all threads count into one shared map instead, which skips merging
+class WordCounter {
+public:
+	WordCounter(const Options &options, CharacterTable &lookup) :
+		mFilename(options.input),
+		mThreads(options.threads),
+		mOwnerBits(ownerBits(options.threads)),
+		mMapped(options.mapped),
+		mLookup(lookup),
+		mWorkers(new Worker[options.threads]),
+		mShards(options.threads > 1 && !options.concurrent ? new HashMap[options.threads] : nullptr),
+		mShared(options.concurrent ? new ConcurrentHashMap(options.hash) : nullptr)
+	{
+		for (int i = 0; i < mThreads; i++) {
+			mWorkers[i].map.setIncremental(options.incremental);
+			mWorkers[i].map.setHashFunction(options.hash);
+			if (mShards) {
+				mShards[i].setIncremental(options.incremental);
+				mShards[i].setHashFunction(options.hash);
+			}
+		}
+	}
+
+	~WordCounter()
+	{
+		delete mShared;
+		delete[] mShards;
+		delete[] mWorkers;
+	}
+
+	// False if the input couldn't be read, the error is already printed
+	bool count()
+	{
+		if (mThreads == 1 && !mShared)
+			return parseRange(mWorkers[0], mWorkers[0].map);
+		if (!split())
+			return false;
+		if (mShared)
+			run([this](int i) { countShared(mWorkers[i]); });
+		else {
+			run([this](int i) { countRange(mWorkers[i]); });
+			run([this](int i) { merge(i); });
+		}
+		for (int i = 0; i < mThreads; i++)
+			if (mWorkers[i].failed)
+				return false;
+		return true;
+	}
+
+	// Call f(key, hash, count) for every counted word
+	template <typename Function>
+	void forEach(Function f) const
+	{
+		if (mShared)
+			mShared->forEach(f);
+		else if (mThreads == 1)
+			mWorkers[0].map.forEach(f);
+		else
+			for (int i = 0; i < mThreads; i++)
+				mShards[i].forEach(f);
+	}
+
+	void toList(WordList &list) const
+	{
+		if (mShared) {
+			mShared->toList(list);
+			return;
+		}
+		if (mThreads == 1) {
+			mWorkers[0].map.toList(list);
+			return;
+		}
+		size_t total = 0;
+		for (int i = 0; i < mThreads; i++)
+			total += mShards[i].size();
+		list.reserve(total);
+		list.clear();
+		for (int i = 0; i < mThreads; i++)
+			mShards[i].forEach([&list](const String &key, UINT /*hash*/, int val) { list.add(WordCount(key, val)); });
+	}
+private:
+	struct Entry {
+		String key;
+		UINT hash;
+		int count;
+	};
+	struct Worker {
+		long long offset{ 0 };
+		long long length{ LLONG_MAX }; // Whole file unless it's split
+		StringPool strings; // Words of the concurrent map, other maps store their own
+		HashMap map;
+		Vector<Entry> *outbox{ nullptr }; // Counted words grouped by the shard that owns them
+		bool failed{ false }; // Range couldn't be read
+		~Worker()
+		{
+			delete[] outbox;
+		}
+	};
+private:
+	const char *mFilename;
+	int mThreads;
+	int mOwnerBits; // Top bits of the hash that pick the owner of a word
+	bool mMapped;
+	CharacterTable &mLookup;
+	Worker *mWorkers;
+	HashMap *mShards;
+	ConcurrentHashMap *mShared;
+
+	// Call f(i) in mThreads threads and wait for all of them
+	template <typename Function>
+	void run(Function f)
+	{
+		runThreads(mThreads, f);
+	}
+
+	// Split the file in roughly equal ranges that don't cut any word in two
+	bool split()
+	{
+		FILE *input;
+		if (fopen_s(&input, mFilename, "rb")) {
+			perror(mFilename);
+			return false;
+		}
+		_fseeki64(input, 0, SEEK_END);
+		long long size = _ftelli64(input);
+		long long start = 0;
+		for (int i = 0; i < mThreads; i++) {
+			long long end = i == mThreads - 1 ? size : size / mThreads * (i + 1);
+			if (end < start) // Previous boundary was moved past this one
+				end = start;
+			if (end < size) {
+				// Move the boundary forward past the word it lands in
+				_fseeki64(input, end, SEEK_SET);
+				int c;
+				while (end < size && (c = fgetc(input)) != EOF && mLookup.valid[c])
+					end++;
+			}
+			mWorkers[i].offset = start;
+			mWorkers[i].length = end - start;
+			start = end;
+		}
+		fclose(input);
+		return true;
+	}
+
+	// Enough bits to split words between the threads within a few percent
+	static int ownerBits(int threads)
+	{
+		int bits = 2;
+		while ((1 << (bits - 2)) < threads)
+			bits++;
+		return bits;
+	}
+
+	// Thread which owns the word with this hash. Only the top mOwnerBits bits are used: a shard map takes the 7 low
+	// bits for control bytes and the ones above them for the slot, which reach the owner bits only past 2^(25 - mOwnerBits)
+	// slots. If they overlapped, every word of a shard would start probing in the same part of its table
+	int owner(UINT hash) const
+	{
+		return (int)(((unsigned long long)(hash >> (32 - mOwnerBits)) * mThreads) >> mOwnerBits);
+	}
+
+	// Count words of the worker's range into the map. False if the file couldn't be opened
+	template <typename Map>
+	bool parseRange(Worker &worker, Map &map)
+	{
+		Parser p;
+#ifdef __MAPPED_READER__
+		if (mMapped) {
+			MappedReader reader(mFilename, worker.offset, worker.length);
+			if (reader.failed())
+				return false;
+			p.parse(reader, mLookup, worker.strings, map);
+			return true;
+		}
+#endif
+		Reader reader(mFilename, worker.offset, worker.length);
+		if (reader.failed())
+			return false;
+		p.parse(reader, mLookup, worker.strings, map);
+		return true;
+	}
+
+	void countRange(Worker &worker)
+	{
+		worker.failed = !parseRange(worker, worker.map);
+		worker.outbox = new Vector<Entry>[mThreads];
+		worker.map.forEach([this, &worker](const String &key, UINT hash, int val) {
+			worker.outbox[owner(hash)].add(Entry{ key, hash, val });
+		});
+	}
+
+	void countShared(Worker &worker)
+	{
+		worker.failed = !parseRange(worker, *mShared);
+	}
+
+	void merge(int shard)
+	{
+		int total = 0;
+		for (int i = 0; i < mThreads; i++)
+			total += mWorkers[i].outbox[shard].size();
+		if (total > (int)HashMap::START_SIZE)
+			mShards[shard].reserve(total);
+		for (int i = 0; i < mThreads; i++)
+			for (auto &entry : mWorkers[i].outbox[shard])
+				mShards[shard].at(entry.key, entry.hash) += entry.count;
+	}
+};
+
+#pragma endregion
+
+#pragma region Sorting: Ordering the word list for output
+
+// Sort [begin, end) in parts by several threads, then merge the parts pairwise
+template <typename Compare>
+void parallelSort(WordCount *begin, WordCount *end, int threads, Compare less)
+{
+	WordCount **bounds = new WordCount*[threads + 1];
+	for (int i = 0; i <= threads; i++)
+		bounds[i] = begin + (end - begin) * i / threads;
+	runThreads(threads, [bounds, less](int i) { std::sort(bounds[i], bounds[i + 1], less); });
+	for (int width = 1; width < threads; width *= 2) {
+		int merges = (threads + 2 * width - 1) / (2 * width);
+		runThreads(merges, [bounds, less, width, threads](int i) {
+			int first = 2 * width * i;
+			int middle = __MIN(first + width, threads);
+			int last = __MIN(first + 2 * width, threads);
+			std::inplace_merge(bounds[first], bounds[middle], bounds[last], less);
+		});
+	}
+	delete[] bounds;
+}
+
+// Same order as sorting with WordCount::greater, but counts aren't compared: most words are rare,
+// so every count below BUCKETS gets its own bucket and only the few more frequent words are compared.
+// Strings are compared only within groups of equal counts, which are sorted by several threads
+void sortByCount(WordList &list, int threads)
+{
+	const int BUCKETS = 1 << 16;
+	int size = list.size();
+	if (size < 2)
+		return;
+	// Bucket 0 holds the frequent words, then counts go down from BUCKETS - 1 to 1
+	auto bucket = [](int count) { return count >= BUCKETS ? 0 : BUCKETS - count; };
+	int *starts = new int[BUCKETS + 1]();
+	for (auto &w : list)
+		starts[bucket(w.count) + 1]++;
+	for (int i = 0; i < BUCKETS; i++)
+		starts[i + 1] += starts[i];
+	int *next = new int[BUCKETS];
+	memcpy(next, starts, BUCKETS * sizeof(int));
+	WordCount *sorted = new WordCount[size];
+	for (auto &w : list)
+		sorted[next[bucket(w.count)]++] = w;
+	std::copy(sorted, sorted + size, list.begin());
+	delete[] sorted;
+	delete[] next;
+
+	// Every group of two words or more still has to be sorted, largest first
+	struct Group {
+		int begin, end;
+	};
+	Vector<Group> groups;
+	for (int i = 0; i < BUCKETS; i++)
+		if (starts[i + 1] - starts[i] > 1)
+			groups.add(Group{ starts[i], starts[i + 1] });
+	delete[] starts;
+	std::sort(groups.begin(), groups.end(), [](const Group &a, const Group &b) { return a.end - a.begin > b.end - b.begin; });
+
+	WordCount *words = list.begin();
+	auto alphabetical = [](const WordCount &a, const WordCount &b) { return a.word > b.word; };
+	auto sortGroup = [words, alphabetical](const Group &g) {
+		if (g.begin == 0) // Frequent words, their counts differ
+			std::sort(words + g.begin, words + g.end, WordCount::greater);
+		else
+			std::sort(words + g.begin, words + g.end, alphabetical);
+	};
+	int group = 0;
+	if (threads > 1) {
+		// A group too large for one thread is sorted by all of them, the rest are shared out
+		for (; group < groups.size() && groups[group].end - groups[group].begin > size / threads; group++) {
+			Group &g = groups[group];
+			if (g.begin == 0)
+				parallelSort(words + g.begin, words + g.end, threads, WordCount::greater);
+			else
+				parallelSort(words + g.begin, words + g.end, threads, alphabetical);
+		}
+		std::atomic<int> taken(group);
+		runThreads(threads, [&groups, &taken, &sortGroup](int) {
+			for (int i = taken++; i < groups.size(); i = taken++)
+				sortGroup(groups[i]);
+		});
+		return;
+	}
+	for (; group < groups.size(); group++)
+		sortGroup(groups[group]);
+}
+
+#pragma endregion
+
+#pragma region Dictionary: Word counts kept in a file between runs
+
+// Position-independent file, so it's mapped and queried as it is: a header, an open addressing table of
+// capacity slots with linear probing, then the words back to back. Slots point to words by offset from
+// the first one and empty slots have zero count. Integers are in native byte order.
+// Later runs append delta segments after the words instead of rewriting the table: a segment header and
+// records of words with the counts to add. On open they are summed into a small index next to the table.
+// Once deltas grow to half of the table, everything is merged into a new file
+class Dictionary {
+public:
+	const static UINT VERSION = 2;
+
+	// Open the file if it exists, check valid() before using it
+	explicit Dictionary(const char *filename) :
+		mData(nullptr),
+		mSize(0),
+		mExists(false),
+		mHeader(nullptr),
+		mSlots(nullptr),
+		mStrings(nullptr),
+		mHashFunction(nullptr),
+		mDeltas(nullptr),
+		mDeltaCapacity(0),
+		mDeltaWords(0),
+		mValidSize(0)
+	{
+#ifdef __MAPPED_READER__
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			mExists = errno != ENOENT; // Before perror, which may change errno
+			if (mExists)
+				perror(filename);
+			return;
+		}
+		mExists = true;
+		struct stat info;
+		if (fstat(fd, &info) != 0) {
+			perror(filename);
+			close(fd);
+			return; // Not valid
+		}
+		if (info.st_size > 0) {
+			void *mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapping != MAP_FAILED) {
+				mData = reinterpret_cast<char *>(mapping);
+				mSize = (size_t)info.st_size;
+			}
+			else
+				perror(filename);
+		}
+		close(fd);
+#else
+		FILE *input;
+		if (fopen_s(&input, filename, "rb")) {
+			mExists = errno != ENOENT; // Before perror, which may change errno
+			if (mExists)
+				perror(filename);
+			return;
+		}
+		mExists = true;
+		_fseeki64(input, 0, SEEK_END);
+		long long end = _ftelli64(input);
+		if (end < 0) {
+			perror(filename);
+			fclose(input);
+			return; // Not valid
+		}
+		size_t size = (size_t)end;
+		_fseeki64(input, 0, SEEK_SET);
+		// Whole words keep the header, slots and records aligned
+		mData = reinterpret_cast<char *>(new uint64_t[size / sizeof(uint64_t) + 1]);
+		mSize = fread(mData, 1, size, input);
+		fclose(input);
+#endif
+		check();
+		if (mHeader)
+			readDeltas();
+	}
+
+	~Dictionary()
+	{
+		delete[] mDeltas;
+#ifdef __MAPPED_READER__
+		if (mData)
+			munmap(mData, mSize);
+#else
+		delete[] reinterpret_cast<uint64_t *>(mData);
+#endif
+	}
+
+	bool exists() const
+	{
+		return mExists;
+	}
+
+	bool valid() const
+	{
+		return mHeader != nullptr;
+	}
+
+	// Words in the table, words that are only in deltas aren't included
+	size_t size() const
+	{
+		return mHeader ? (size_t)mHeader->count : 0;
+	}
+
+	// Records in all delta segments, repeated words included
+	size_t deltaWords() const
+	{
+		return (size_t)mDeltaWords;
+	}
+
+	// False if the last segment was cut short, e.g. by a crash while appending. It's ignored then,
+	// and nothing may be appended after it
+	bool complete() const
+	{
+		return mValidSize == mSize;
+	}
+
+	// Name of the function the stored hashes were calculated with
+	const char *hashName() const
+	{
+		return mHeader ? mHeader->hash : nullptr;
+	}
+
+	// Count of the word, 0 if it isn't there
+	uint64_t find(const String &word) const
+	{
+		if (!mHeader)
+			return 0;
+		UINT hash = mHashFunction(word.str, word.len);
+		const Slot *slot = findSlot(word.str, (UINT)word.len, hash);
+		const Delta *delta = findDelta(word.str, (UINT)word.len, hash);
+		return (slot ? slot->count : 0) + (delta ? delta->count : 0);
+	}
+
+	// Call f(key, hash, count) for every stored word. Keys point into the file and stay valid while it's open
+	template <typename Function>
+	void forEach(Function f) const {
+		if (!mHeader)
+			return;
+		for (size_t i = 0; i < mHeader->capacity; i++) {
+			const Slot &slot = mSlots[i];
+			if (!slot.count || !inside(slot))
+				continue;
+			const char *str = mStrings + slot.offset;
+			const Delta *delta = findDelta(str, slot.len, slot.hash);
+			f(String(const_cast<char *>(str), slot.len), slot.hash, slot.count + (delta ? delta->count : 0));
+		}
+		for (size_t i = 0; i < mDeltaCapacity; i++)
+			if (mDeltas[i].record && !mDeltas[i].in_table)
+				f(String(const_cast<char *>(chars(mDeltas[i].record)), mDeltas[i].record->len), mDeltas[i].record->hash, mDeltas[i].count);
+	}
+
+	// Save words into filename as a new table without deltas. forEachWord(f) calls f(key, hash, count)
+	// for each of the count words, in the same order every time. They are written to a temporary file first,
+	// which then replaces the old one, so readers never see a half-written dictionary
+	template <typename Source>
+	static bool write(const char *filename, size_t count, Source forEachWord, const char *hash_name)
+	{
+		Header header = {};
+		memcpy(header.magic, MAGIC, sizeof(header.magic));
+		header.version = VERSION;
+		header.count = count;
+		// Half empty table keeps linear probes short
+		header.capacity = MIN_CAPACITY;
+		while (header.capacity < 2 * header.count)
+			header.capacity *= 2;
+		strncpy(header.hash, hash_name, sizeof(header.hash) - 1);
+		Slot *slots = reinterpret_cast<Slot *>(calloc((size_t)header.capacity, sizeof(Slot)));
+		if (!slots) {
+			fprintf(stderr, "%s: not enough memory for %llu slots\n", filename, (unsigned long long)header.capacity);
+			return false;
+		}
+		size_t mask = (size_t)header.capacity - 1;
+		uint64_t offset = 0;
+		forEachWord([&](const String &key, UINT hash, uint64_t count) {
+			size_t i = hash & mask;
+			while (slots[i].count)
+				i = (i + 1) & mask;
+			slots[i] = Slot{ count, offset, hash, (UINT)key.len };
+			offset += key.len;
+		});
+		header.strings = offset;
+
+		size_t length = strlen(filename);
+		char *temp = new char[length + 5];
+		memcpy(temp, filename, length);
+		memcpy(temp + length, ".tmp", 5);
+		FILE *output;
+		bool ok = !fopen_s(&output, temp, "wb");
+		if (ok) {
+			fwrite(&header, sizeof(header), 1, output);
+			fwrite(slots, sizeof(Slot), (size_t)header.capacity, output);
+			// Same order as above, so words land at their offsets
+			forEachWord([output](const String &key, UINT, uint64_t) { fwrite(key.str, 1, key.len, output); });
+			const char padding[sizeof(uint64_t)] = {};
+			fwrite(padding, 1, (size_t)(align(offset) - offset), output);
+			// On disk before it replaces the old file, or a crash could leave an empty file under the old name
+			ok = !ferror(output) && sync(output);
+			ok = !fclose(output) && ok;
+		}
+#ifdef _MSC_VER
+		remove(filename); // Windows doesn't rename over an existing file
+#endif
+		if (ok)
+			ok = !rename(temp, filename);
+		if (!ok) {
+			perror(temp);
+			remove(temp);
+		}
+		else
+			syncDirectory(filename); // Rename itself is durable only after its directory is
+		delete[] temp;
+		free(slots);
+		return ok;
+	}
+
+	// Append count words as one delta segment. forEachWord(f) is the same as for write(), hashes must be made
+	// by the dictionary's function. Only for complete() dictionaries, or the segment would be unreachable
+	template <typename Source>
+	static bool append(const char *filename, size_t count, Source forEachWord)
+	{
+		if (!count)
+			return true;
+		Segment segment = {};
+		memcpy(segment.magic, SEGMENT_MAGIC, sizeof(segment.magic));
+		segment.words = count;
+		forEachWord([&segment](const String &key, UINT, uint64_t) { segment.bytes += recordSize((UINT)key.len); });
+		FILE *output;
+		if (fopen_s(&output, filename, "ab")) {
+			perror(filename);
+			return false;
+		}
+		fwrite(&segment, sizeof(segment), 1, output);
+		forEachWord([output](const String &key, UINT hash, uint64_t count) {
+			Record record = { count, hash, (UINT)key.len };
+			const char padding[sizeof(uint64_t)] = {};
+			fwrite(&record, sizeof(record), 1, output);
+			fwrite(key.str, 1, key.len, output);
+			fwrite(padding, 1, recordSize(record.len) - sizeof(record) - key.len, output);
+		});
+		bool ok = !ferror(output) && sync(output);
+		ok = !fclose(output) && ok;
+		if (!ok)
+			perror(filename);
+		return ok;
+	}
+private:
+	constexpr static const char *MAGIC = "WORDDICT";
+	constexpr static const char *SEGMENT_MAGIC = "WORDDELT";
+	const static uint64_t MIN_CAPACITY = 16;
+
+	struct Header {
+		char magic[8];
+		UINT version;
+		UINT reserved;
+		uint64_t count; // Words in the table
+		uint64_t capacity; // Slots in the table, a power of 2
+		uint64_t strings; // Bytes of words after the table, delta segments follow them once padded
+		char hash[16]; // Name of the hash function, zero terminated
+	};
+	struct Slot {
+		uint64_t count;
+		uint64_t offset; // Of the first character from the start of words
+		UINT hash;
+		UINT len;
+	};
+	struct Segment {
+		char magic[8];
+		uint64_t words; // Records in the segment
+		uint64_t bytes; // Of the records following the segment header
+	};
+	// Characters follow the record, padded to whole 8 bytes
+	struct Record {
+		uint64_t count; // To add to the word
+		UINT hash;
+		UINT len;
+	};
+	// Sum of the records of one word in all segments
+	struct Delta {
+		const Record *record{ nullptr }; // First record of the word, empty entry if null
+		uint64_t count{ 0 };
+		bool in_table{ false };
+	};
+
+	char *mData;
+	size_t mSize;
+	bool mExists;
+	const Header *mHeader;
+	const Slot *mSlots;
+	const char *mStrings;
+	HashFunc mHashFunction;
+	Delta *mDeltas; // Open addressing with linear probing, like the table
+	size_t mDeltaCapacity;
+	uint64_t mDeltaWords;
+	size_t mValidSize; // Table and the segments that were read whole
+
+	// Flush the file to disk, not just to the system
+	static bool sync(FILE *file)
+	{
+		if (fflush(file))
+			return false;
+#ifdef _WIN32
+		return !_commit(_fileno(file));
+#else
+		return !fsync(fileno(file));
+#endif
+	}
+
+	static void syncDirectory(const char *filename)
+	{
+#ifndef _WIN32
+		const char *slash = strrchr(filename, '/');
+		size_t length = slash ? (size_t)(slash - filename) + 1 : 0;
+		char *directory = new char[length + 2];
+		memcpy(directory, filename, length);
+		strcpy(directory + length, ".");
+		int fd = open(directory, O_RDONLY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+		delete[] directory;
+#endif
+	}
+
+	// Words and records are padded to whole 8 bytes, so segments and records stay aligned
+	static uint64_t align(uint64_t bytes)
+	{
+		return (bytes + sizeof(uint64_t) - 1) & ~(uint64_t)(sizeof(uint64_t) - 1);
+	}
+
+	static uint64_t recordSize(UINT len)
+	{
+		return sizeof(Record) + align(len);
+	}
+
+	static const char *chars(const Record *record)
+	{
+		return reinterpret_cast<const char *>(record + 1);
+	}
+
+	// Use the file only if its parts fit exactly, it's open and can be broken
+	void check()
+	{
+		if (mSize < sizeof(Header))
+			return;
+		const Header *header = reinterpret_cast<const Header *>(mData);
+		if (memcmp(header->magic, MAGIC, sizeof(header->magic)) || header->version != VERSION
+			|| !header->hash[0] || header->hash[sizeof(header->hash) - 1])
+			return;
+		uint64_t capacity = header->capacity;
+		if (capacity == 0 || (capacity & (capacity - 1)) || capacity > (mSize - sizeof(Header)) / sizeof(Slot)
+			|| header->count > capacity)
+			return;
+		uint64_t table = sizeof(Header) + capacity * sizeof(Slot);
+		if (header->strings > mSize - table || align(header->strings) > mSize - table)
+			return;
+		mHashFunction = findHash(header->hash);
+		if (!mHashFunction)
+			return;
+		mHeader = header;
+		mSlots = reinterpret_cast<const Slot *>(mData + sizeof(Header));
+		mStrings = mData + table;
+		mValidSize = (size_t)(table + align(header->strings));
+	}
+
+	// Segment that fits in the file and whose records add up to its size, nullptr if there is none at pos
+	const Segment *segmentAt(size_t pos) const
+	{
+		if (mSize - pos < sizeof(Segment))
+			return nullptr;
+		const Segment *segment = reinterpret_cast<const Segment *>(mData + pos);
+		if (memcmp(segment->magic, SEGMENT_MAGIC, sizeof(segment->magic)) || segment->bytes > mSize - pos - sizeof(Segment))
+			return nullptr;
+		uint64_t offset = 0;
+		for (uint64_t i = 0; i < segment->words; i++) {
+			if (segment->bytes - offset < sizeof(Record))
+				return nullptr;
+			const Record *record = reinterpret_cast<const Record *>(mData + pos + sizeof(Segment) + offset);
+			if (recordSize(record->len) > segment->bytes - offset)
+				return nullptr;
+			offset += recordSize(record->len);
+		}
+		return offset == segment->bytes ? segment : nullptr;
+	}
+
+	// Sum records of all whole segments into the delta index
+	void readDeltas()
+	{
+		size_t pos = mValidSize;
+		for (const Segment *segment; (segment = segmentAt(pos)); pos += sizeof(Segment) + (size_t)segment->bytes)
+			mDeltaWords += segment->words;
+		if (!mDeltaWords) {
+			mValidSize = pos;
+			return;
+		}
+		mDeltaCapacity = (size_t)MIN_CAPACITY;
+		while (mDeltaCapacity < 2 * mDeltaWords)
+			mDeltaCapacity *= 2;
+		mDeltas = new Delta[mDeltaCapacity];
+		size_t mask = mDeltaCapacity - 1;
+		for (pos = mValidSize; pos < mSize;) {
+			const Segment *segment = segmentAt(pos);
+			if (!segment)
+				break;
+			const char *p = mData + pos + sizeof(Segment);
+			for (uint64_t i = 0; i < segment->words; i++) {
+				const Record *record = reinterpret_cast<const Record *>(p);
+				size_t j = record->hash & mask;
+				while (mDeltas[j].record && !same(mDeltas[j].record, chars(record), record->len, record->hash))
+					j = (j + 1) & mask;
+				if (!mDeltas[j].record) {
+					mDeltas[j].record = record;
+					mDeltas[j].in_table = findSlot(chars(record), record->len, record->hash) != nullptr;
+				}
+				mDeltas[j].count += record->count;
+				p += recordSize(record->len);
+			}
+			pos += sizeof(Segment) + (size_t)segment->bytes;
+		}
+		mValidSize = pos;
+	}
+
+	const Slot *findSlot(const char *str, UINT len, UINT hash) const
+	{
+		size_t mask = (size_t)mHeader->capacity - 1;
+		for (size_t i = hash & mask, probes = 0; mSlots[i].count && probes <= mask; i = (i + 1) & mask, probes++) {
+			const Slot &slot = mSlots[i];
+			if (slot.hash == hash && slot.len == len && inside(slot) && !memcmp(mStrings + slot.offset, str, len))
+				return &slot;
+		}
+		return nullptr;
+	}
+
+	const Delta *findDelta(const char *str, UINT len, UINT hash) const
+	{
+		if (!mDeltas)
+			return nullptr;
+		size_t mask = mDeltaCapacity - 1;
+		for (size_t i = hash & mask; mDeltas[i].record; i = (i + 1) & mask)
+			if (same(mDeltas[i].record, str, len, hash))
+				return mDeltas + i;
+		return nullptr;
+	}
+
+	static bool same(const Record *record, const char *str, UINT len, UINT hash)
+	{
+		return record->hash == hash && record->len == len && !memcmp(chars(record), str, len);
+	}
+
+	// Word of the slot is within the file
+	bool inside(const Slot &slot) const
+	{
+		return slot.offset <= mHeader->strings && slot.len <= mHeader->strings - slot.offset;
+	}
+};
+
+// Add counted words to the dictionary. Usually they are appended as a delta segment, which takes time
+// of the counted words only. When the hash function changes or deltas would outgrow half of the table,
+// saved and counted words are merged into a new table instead. If total isn't null, it gets all words
+// with their updated counts
+bool updateDictionary(const Options &options, const WordCounter &counter, HashMap *total)
+{
+	const char *name = hashName(options.hash);
+	size_t counted = 0;
+	counter.forEach([&counted](const String &, UINT, int) { counted++; });
+	bool ok;
+	{
+		Dictionary saved(options.dictionary);
+		if (saved.exists() && !saved.valid()) {
+			fprintf(stderr, "%s: not a word dictionary\n", options.dictionary);
+			return false;
+		}
+		// Stored hashes are only reused if they were made by the same function
+		bool same_hash = saved.valid() && !strcmp(saved.hashName(), name);
+		if (same_hash && saved.complete() && saved.deltaWords() + counted <= saved.size() / 2)
+			ok = Dictionary::append(options.dictionary, counted, [&counter](auto f) { counter.forEach(f); });
+		else {
+			// Map counts are int, so they hold an index into 64-bit counts instead
+			HashMap index(options.hash);
+			Vector<uint64_t> counts;
+			index.reserve(saved.size() + saved.deltaWords() + counted);
+			auto add = [&index, &counts](const String &key, UINT hash, uint64_t count) {
+				int &i = index.at(key, hash);
+				if (!i) {
+					counts.add(0);
+					i = counts.size();
+				}
+				counts[i - 1] += count;
+			};
+			saved.forEach([&](const String &key, UINT hash, uint64_t count) { add(key, same_hash ? hash : index.hash(key), count); });
+			counter.forEach(add);
+			ok = Dictionary::write(options.dictionary, index.size(), [&index, &counts](auto f) {
+				index.forEach([&f, &counts](const String &key, UINT hash, int i) { f(key, hash, counts[i - 1]); });
+			}, name);
+		} // Index has its own copies of the words, so the file is closed before it's replaced
+	}
+	if (!ok || !total)
+		return ok;
+	Dictionary updated(options.dictionary);
+	if (!updated.valid()) {
+		fprintf(stderr, "%s: not a word dictionary\n", options.dictionary);
+		return false;
+	}
+	// Dictionary uses the requested function now. Output counts are int, like everywhere else
+	total->reserve(updated.size() + updated.deltaWords());
+	updated.forEach([total](const String &key, UINT hash, uint64_t count) { total->at(key, hash) += (int)__MIN(count, (uint64_t)INT_MAX); });
+	return true;
+}
+
+#pragma endregion
+
+#pragma region HashBenchmark: Compare hash functions on a corpus
+
+// Count the file with every hash function in one thread and report the whole run time, hashing time per word
+// and how many groups lookups have to look at
+bool benchmarkHashes(const Options &options, CharacterTable &lookup)
+{
+	typedef std::chrono::steady_clock Clock;
+	printf("%-8s %10s %8s   %% of unique words found in 1, 2, 3, 4, 5+ groups\n", "hash", "total ms", "ns/word");
+	for (auto &hash : HASH_FUNCTIONS) {
+		Clock::time_point start = Clock::now();
+		Reader reader(options.input);
+		if (reader.failed())
+			return false;
+		StringPool strings;
+		HashMap map(hash.function);
+		Parser p;
+		p.parse(reader, lookup, strings, map);
+		WordList list;
+		map.toList(list);
+		std::sort(list.begin(), list.end(), WordCount::greater);
+		double total = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		// Every word is hashed as many times as it occurs, same as while counting
+		UINT sink = 0;
+		start = Clock::now();
+		for (auto &w : list)
+			for (int i = 0; i < w.count; i++)
+				sink += hash.function(w.word.str, w.word.len);
+		double hashing = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+		long long words = 0;
+		int groups[5] = { 0 };
+		for (auto &w : list) {
+			words += w.count;
+			int length = map.probeLength(w.word);
+			groups[__MIN(length, 5) - 1]++;
+		}
+		printf("%-8s %10.1f %8.2f  ", hash.name, total, words ? hashing / words : 0.0);
+		for (int count : groups)
+			printf(" %5.1f", list.size() ? 100.0 * count / list.size() : 0.0);
+		printf(sink == 1 ? " \n" : "\n"); // Use the sum, so hashing isn't optimized out
+	}
+	return true;
+}
+
+#pragma endregion
+
+#ifndef __HASH_NO_MAIN__ // Defined by test drivers that include this file
+
 int main(int argc, char* argv[]) 
 {
-	//struct stat fileinfo;
-	//stat(argv[1], &fileinfo);
-	Reader r(argv[1]);	
+	Options options;
+	if (!options.parse(argc, argv)) {
+		printf("Usage: %s <input> <output> [-t threads] [-c] [-m] [-i] [-f meiyan|fnv1a|murmur3|wy|crc32c] [-k top] [-d dictionary]\n", argv[0]);
+		printf("       %s <input> -b\n", argv[0]);
+		printf("       %s -d <dictionary> -q <word>...\n", argv[0]);
+		return 1;
+	}
 	CharacterTable lookup;
 	auto latin_letters = [](int c) { return c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z'; };
 	lookup.fill(latin_letters);
-	StringPool strings;
-	HashMap map;
+	if (options.benchmark)
+		return benchmarkHashes(options, lookup) ? 0 : 1;
+	if (options.query) {
+		Dictionary dictionary(options.dictionary);
+		if (!dictionary.valid()) {
+			fprintf(stderr, "%s: %s\n", options.dictionary, dictionary.exists() ? "not a word dictionary" : "no such file");
+			return 1;
+		}
+		for (int i = 0; i < options.queries; i++) {
+			// Words are stored in lowercase
+			char *word = options.query[i];
+			for (char *c = word; *c; c++)
+				if (lookup.valid[(UCHAR)*c])
+					*c = (char)lookup.lower[(UCHAR)*c];
+			printf("%llu %s\n", (unsigned long long)dictionary.find(String(word, (int)strlen(word))), word);
+		}
+		return 0;
+	}
+	//struct stat fileinfo;
+	//stat(argv[1], &fileinfo);
 	// Rough estimate is at least 500 unique words per Mb on sufficiently large files (500Mb+)	
 	//map.reserve(fileinfo.st_size/(1024*1024)*500);
-	Parser p;
-	p.parse(r, lookup, strings, map);
+	WordCounter counter(options, lookup);
+	if (!counter.count())
+		return 1;
 	WordList list;
-	map.toList(list);
+	HashMap total(options.hash);
+	if (options.dictionary) {
+		if (!updateDictionary(options, counter, options.output ? &total : nullptr))
+			return 1;
+		total.toList(list);
+	}
+	else
+		counter.toList(list);
+	if (!options.output)
+		return 0;
 	// Sort list in descending order
-	std::sort(list.begin(), list.end(), WordCount::greater);
+	WordCount *last = list.end();
+	if (options.top > 0 && options.top < list.size()) {
+		// Only the most frequent words are written, the rest is left unsorted
+		last = list.begin() + options.top;
+		std::partial_sort(list.begin(), last, list.end(), WordCount::greater);
+	}
+	else
+		sortByCount(list, options.threads);
 	FILE *output;
-	fopen_s(&output, argv[2], "w");
-	for (auto it = list.begin(); it < list.end(); it++) {
+	if (fopen_s(&output, options.output, "w")) {
+		perror(options.output);
+		return 1;
+	}
+	for (auto it = list.begin(); it < last; it++) {
 		fprintf(output, "%d %.*s\n", it->count, it->word.len, it->word.str);
 	}
 	fclose(output);
 	return 0;
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+// Checks of hash.cpp. ConcurrentHashMap is stressed on several threads, through all of its resizes,
+// and compared with HashMap counting the same words on one.
+// Build and run: g++ -std=c++17 -O2 -pthread test.cpp -o test && ./test
+
+#define __HASH_NO_MAIN__
+#include "hash.cpp"
+
+int failures = 0;
+
+void Check(bool ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		failures++;
+}
+
+#pragma region Words: Generated vocabulary and word stream
+
+// Words of different lengths, so both inline and pooled keys of HashMap are used
+class Words {
+public:
+	explicit Words(int vocabulary) :
+		mChars(new char[vocabulary * MAX_LEN]),
+		mWords(new String[vocabulary])
+	{
+		UINT seed = 1;
+		for (int i = 0; i < vocabulary; i++) {
+			char *word = mChars + i * MAX_LEN;
+			int len = 0;
+			// Index in base 26 keeps every word unique, random letters vary the length
+			for (int n = i; n || !len; n /= 26)
+				word[len++] = (char)('a' + n % 26);
+			for (int extra = random(seed) % (MAX_LEN - 6); extra > 0; extra--)
+				word[len++] = (char)('a' + random(seed) % 26);
+			mWords[i] = String(word, len);
+		}
+	}
+
+	~Words()
+	{
+		delete[] mWords;
+		delete[] mChars;
+	}
+
+	const String &operator[](int index) const
+	{
+		return mWords[index];
+	}
+
+	// Stream of count indices, where few words are very frequent and most are rare, like in text
+	static int *stream(int count, int vocabulary, UINT seed)
+	{
+		int *indices = new int[count];
+		for (int i = 0; i < count; i++) {
+			UINT r = random(seed);
+			indices[i] = r % 4 == 0 ? (int)(r >> 8) % 16 : (int)(r >> 8) % vocabulary;
+		}
+		return indices;
+	}
+private:
+	const static int MAX_LEN = 40;
+	char *mChars;
+	String *mWords;
+
+	static UINT random(UINT &seed)
+	{
+		seed = seed * 1103515245 + 12345;
+		return seed >> 4;
+	}
+};
+
+// Sorted by word, so lists of different maps can be compared
+void sortByWord(WordList &list)
+{
+	std::sort(list.begin(), list.end(), [](const WordCount &x, const WordCount &y) { return compare(x.word, y.word) < 0; });
+}
+
+bool same(const WordList &x, const WordList &y)
+{
+	if (x.size() != y.size())
+		return false;
+	for (int i = 0; i < x.size(); i++)
+		if (x[i].count != y[i].count || compare(x[i].word, y[i].word))
+			return false;
+	return true;
+}
+
+#pragma endregion
+
+#pragma region ConcurrentHashMap: Shared counting against one thread
+
+// Every thread counts its part of the stream into one map that starts small, so several resizes happen
+// while others are adding. No increment may be lost or counted twice, and no word may end up in two slots
+void testConcurrentMap(int threads, int vocabulary, int count)
+{
+	Words words(vocabulary);
+	int *stream = Words::stream(count, vocabulary, (UINT)(threads * 7919 + vocabulary));
+
+	HashMap reference;
+	for (int i = 0; i < count; i++)
+		reference[words[stream[i]]]++;
+	WordList expected;
+	reference.toList(expected);
+	sortByWord(expected);
+
+	ConcurrentHashMap map;
+	StringPool *pools = new StringPool[threads];
+	std::thread *workers = new std::thread[threads];
+	for (int t = 0; t < threads; t++)
+		workers[t] = std::thread([&, t]() {
+			// Interleaved, so all threads hit the frequent words at the same time
+			for (int i = t; i < count; i += threads)
+				map.increment(words[stream[i]], pools[t]);
+		});
+	for (int t = 0; t < threads; t++)
+		workers[t].join();
+	delete[] workers;
+	WordList counted;
+	map.toList(counted);
+	sortByWord(counted);
+
+	char what[128];
+	snprintf(what, sizeof(what), "%d threads, %d words of %d: same words and counts as one thread", threads, count, vocabulary);
+	Check(map.size() == (size_t)expected.size() && same(counted, expected), what);
+	delete[] pools;
+	delete[] stream;
+}
+
+#pragma endregion
+
+int main()
+{
+	for (int threads : { 2, 4, 8 }) {
+		testConcurrentMap(threads, 100, 200000); // Small table, contention on the same counters
+		testConcurrentMap(threads, 300000, 1000000); // Many resizes while words are added
+	}
+	if (failures)
+		printf("%d checks failed\n", failures);
+	else
+		printf("all checks passed\n");
+	return failures ? 1 : 0;
+}
\ No newline at end of file